@@ -22,12 +22,43 @@
 #include <coroutine>
 #include <variant>
 #include <memory>
+#include <new>
 #include <atomic>
+#include <mutex>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include <utility>
+#include <iterator>
+#include <functional>
+#include <tuple>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#if __cpp_lib_memory_resource
+    #include <memory_resource>
+#endif
+#if __cpp_lib_ranges
+    #include <ranges>
+#endif
 
 #include <dispatch/dispatch.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
 #ifndef __OBJC__
     #include <Block.h>
 #endif
@@ -56,14 +87,33 @@ enum class SupportsExceptions : bool {
 #define CO_DISPATCH_CONCAT1(a, b) a##b
 #define CO_DISPATCH_CONCAT(a, b) CO_DISPATCH_CONCAT1(a, b)
 
+#ifndef CO_DISPATCH_TRACE
+    #define CO_DISPATCH_TRACE 0
+#endif
+
+#if CO_DISPATCH_TRACE
+    #define CO_DISPATCH_ADD_TRACE_SUFFIX(a) CO_DISPATCH_CONCAT(a, Trace)
+#else
+    #define CO_DISPATCH_ADD_TRACE_SUFFIX(a) a
+#endif
+
 #if OS_OBJECT_USE_OBJC
-    #define CO_DISPATCH_NS CO_DISPATCH_ADD_NS_SUFFIX(CoDispatch)
+    #define CO_DISPATCH_NS CO_DISPATCH_ADD_TRACE_SUFFIX(CO_DISPATCH_ADD_NS_SUFFIX(CoDispatch))
 #else
-    #define CO_DISPATCH_NS CO_DISPATCH_ADD_NS_SUFFIX(CoDispatchCpp)
+    #define CO_DISPATCH_NS CO_DISPATCH_ADD_TRACE_SUFFIX(CO_DISPATCH_ADD_NS_SUFFIX(CoDispatchCpp))
 #endif
 
 inline namespace CO_DISPATCH_NS {
     
+    /**
+     Exception produced by `co_await` on a task or awaitable that was cancelled before it completed
+     */
+    class DispatchCancelled : public std::exception {
+    public:
+        auto what() const noexcept -> const char * override
+            { return "dispatch operation cancelled"; }
+    };
+    
     namespace Util {
         
         //MARK: - Intrusive reference counting
@@ -96,8 +146,17 @@ inline namespace CO_DISPATCH_NS {
             RefcntPtr(RefcntPtr && src) noexcept:
                 m_ptr(std::exchange(src.m_ptr, nullptr))
             {}
-            RefcntPtr & operator=(const RefcntPtr &) = delete;
-            RefcntPtr & operator=(RefcntPtr &&) = delete;
+            RefcntPtr & operator=(const RefcntPtr & src) noexcept {
+                RefcntPtr temp(src);
+                return *this = std::move(temp);
+            }
+            RefcntPtr & operator=(RefcntPtr && src) noexcept {
+                if (this != &src) {
+                    reset();
+                    m_ptr = std::exchange(src.m_ptr, nullptr);
+                }
+                return *this;
+            }
             [[clang::always_inline]] ~RefcntPtr() noexcept {
                 if (m_ptr)
                     m_ptr->subRef();
@@ -329,788 +388,4932 @@ inline namespace CO_DISPATCH_NS {
         private:
             [[no_unique_address]] Storage m_storage;
         };
-        
-        
-        //MARK: - Basic Promise
-        
+
         /**
-         Base class for all coroutine promises in this library
-         
-         Provides services for both server and client sides of a coroutine and communication between them.
-         This is the core class of this library. Everything else just wraps its usages. It implements a state
-         machine that tracks client and server behavior to avoid locking.
+         Alignment that keeps data written by different threads on separate cache lines
+         */
+#if defined(__APPLE__) && defined(__aarch64__)
+        inline constexpr size_t cacheLineSize = 128;
+#else
+        inline constexpr size_t cacheLineSize = 64;
+#endif
         
-         @tparam Derived the derived class for CRTP
-         @tparam DelayedValue type of ValueCarrier to store asynchronous result
+        //MARK: - Coroutine frame allocation
+
+        /**
+         Recycling allocator for coroutine frames and awaitable states
+
+         Coroutine frames and the shared states of `co_dispatch`/`makeAwaitable` calls are short lived and come
+         in a handful of sizes so recycling them is much cheaper than going to the global allocator every time.
+         Each thread owns a cache of size-bucketed free lists which it allocates from and frees into without
+         any synchronization.
+
+         Frames are often destroyed on a different GCD worker than the one that created them. Such frames
+         are pushed onto the owning cache's lock-free return stack which the owner drains when it runs out
+         of local blocks. The owning cache outlives its thread if any of its blocks are still in use elsewhere.
+
+         Frames too large for any bucket go straight to the global allocator.
          */
-        template<class Derived, class DelayedValue>
-        class BasicPromise {
+        class FramePool {
         public:
-            //Lifecycle
-            
-            /**
-             To be called from `await_ready`
-             @returns Whether the result is already available
-             */
-            auto isReady() const noexcept -> bool {
-                if (m_resumeQueue) {
-                    if (m_when != DISPATCH_TIME_NOW)
-                        return false;
-                    m_awaiterOnResumeQueue = isCurrentQueue(m_resumeQueue);
-                    if (!m_awaiterOnResumeQueue)
-                        return false;
+            static auto allocate(size_t size) -> void * _Nonnull {
+                auto bucket = bucketFor(size);
+                if (bucket >= s_bucketCount)
+                    return ::operator new(size);
+
+                Header * header;
+                if (auto * cache = Cache::current()) {
+                    header = cache->pop(bucket);
+                    if (!header)
+                        header = static_cast<Header *>(::operator new(blockSize(bucket)));
+                    header->owner = cache;
+                    cache->noteAllocated();
+                } else {
+                    //thread is exiting and its cache is gone
+                    header = static_cast<Header *>(::operator new(blockSize(bucket)));
+                    header->owner = nullptr;
                 }
-                auto state = m_state.load(std::memory_order_acquire);
-                assert(state == s_runningMarker || state == s_completedMarker);
-                return state != s_runningMarker;
+                header->bucket = bucket;
+                return header + 1;
             }
-            
-            /**
-             To be called from `await_resume`
-             @returns whether the client should remain suspended
-             */
-            auto clientAwait(std::coroutine_handle<> h) noexcept -> bool {
-                auto oldState = m_state.exchange(reinterpret_cast<uintptr_t>(h.address()), std::memory_order_acq_rel);
-                assert(oldState != s_notStartedMarker && oldState != s_abandonedMarker);
-                if (oldState != s_runningMarker) {
-                    if (m_resumeQueue && !m_awaiterOnResumeQueue) {
-                        resumeHandleAsync(h.address());
-                        return true;
+
+            static void deallocate(void * _Nonnull ptr, size_t size) noexcept {
+                if (bucketFor(size) >= s_bucketCount) {
+                    ::operator delete(ptr);
+                    return;
+                }
+
+                auto * header = static_cast<Header *>(ptr) - 1;
+                auto * owner = header->owner;
+                if (!owner)
+                    ::operator delete(header);
+                else if (owner->isCurrent())
+                    owner->pushLocal(header);
+                else
+                    owner->pushRemote(header);
+            }
+
+        private:
+            class Cache;
+
+            struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) Header {
+                union {
+                    Cache * _Nullable owner;    //while allocated
+                    Header * _Nullable next;    //while on a free list
+                };
+                size_t bucket;
+            };
+
+            static constexpr size_t s_granularity = 64;
+            static constexpr size_t s_bucketCount = 16;
+            static constexpr size_t s_maxCachedPerBucket = 64;
+
+            static constexpr auto bucketFor(size_t size) noexcept -> size_t
+                { return (size + sizeof(Header) - 1) / s_granularity; }
+            static constexpr auto blockSize(size_t bucket) noexcept -> size_t
+                { return (bucket + 1) * s_granularity; }
+
+            class Cache {
+            public:
+                static auto current() noexcept -> Cache * _Nullable {
+                    if (auto * ret = t_current)
+                        return ret;
+                    return create();
+                }
+
+                auto isCurrent() const noexcept -> bool
+                    { return this == t_current; }
+
+                auto pop(size_t bucket) noexcept -> Header * _Nullable {
+                    if (!m_lists[bucket])
+                        drainReturned();
+                    auto * ret = m_lists[bucket];
+                    if (ret) {
+                        m_lists[bucket] = ret->next;
+                        --m_counts[bucket];
                     }
-                    return false;
+                    return ret;
                 }
-                return true;
+
+                void noteAllocated() noexcept
+                    { ++m_allocated; }
+
+                void pushLocal(Header * _Nonnull header) noexcept {
+                    ++m_localFreed;
+                    cache(header);
+                }
+
+                void pushRemote(Header * _Nonnull header) noexcept {
+                    auto * head = m_returned.load(std::memory_order_relaxed);
+                    do {
+                        header->next = head;
+                    } while (!m_returned.compare_exchange_weak(head, header, std::memory_order_release, std::memory_order_relaxed));
+                    //once the owner thread is gone the last returned block gets to delete the cache
+                    if (m_remoteFreed.fetch_add(1, std::memory_order_acq_rel) + 1 == 0)
+                        delete this;
+                }
+
+            private:
+                struct Owner {
+                    ~Owner() noexcept {
+                        t_exited = true;
+                        if (auto * cache = std::exchange(t_current, nullptr))
+                            cache->ownerExited();
+                    }
+                };
+
+                Cache() noexcept = default;
+                ~Cache() noexcept
+                    { trim(); }
+
+                static auto create() noexcept -> Cache * _Nullable {
+                    if (t_exited)
+                        return nullptr;
+                    static thread_local Owner owner;
+                    t_current = new (std::nothrow) Cache;
+                    return t_current;
+                }
+
+                void cache(Header * _Nonnull header) noexcept {
+                    auto bucket = header->bucket;
+                    if (m_counts[bucket] == s_maxCachedPerBucket) {
+                        ::operator delete(header);
+                        return;
+                    }
+                    header->next = m_lists[bucket];
+                    m_lists[bucket] = header;
+                    ++m_counts[bucket];
+                }
+
+                void drainReturned() noexcept {
+                    auto * returned = m_returned.exchange(nullptr, std::memory_order_acquire);
+                    while (returned)
+                        cache(std::exchange(returned, returned->next));
+                }
+
+                void trim() noexcept {
+                    drainReturned();
+                    for (size_t i = 0; i < s_bucketCount; ++i) {
+                        while (m_lists[i])
+                            ::operator delete(std::exchange(m_lists[i], m_lists[i]->next));
+                        m_counts[i] = 0;
+                    }
+                }
+
+                void ownerExited() noexcept {
+                    trim();
+                    //Every block we handed out is either back locally or will eventually be returned
+                    //remotely. Remote returns count up towards the number of blocks not returned locally.
+                    auto outstanding = intptr_t(m_allocated - m_localFreed);
+                    if (m_remoteFreed.fetch_sub(outstanding, std::memory_order_acq_rel) - outstanding == 0)
+                        delete this;
+                }
+
+            private:
+                static inline thread_local Cache * _Nullable t_current = nullptr;
+                static inline thread_local bool t_exited = false;
+
+                Header * _Nullable m_lists[s_bucketCount] = {};
+                uint32_t m_counts[s_bucketCount] = {};
+                size_t m_allocated = 0;
+                size_t m_localFreed = 0;
+
+                alignas(cacheLineSize) std::atomic<Header *> m_returned = nullptr;
+                std::atomic<intptr_t> m_remoteFreed = 0;
+            };
+        };
+
+#if __cpp_lib_memory_resource
+        template<class Alloc>
+        struct FrameAllocatorFor {
+            using Type = Alloc;
+        };
+        template<class Resource>
+        requires(std::is_convertible_v<Resource *, std::pmr::memory_resource *>)
+        struct FrameAllocatorFor<Resource *> {
+            using Type = std::pmr::polymorphic_allocator<std::byte>;
+        };
+#else
+        template<class Alloc>
+        struct FrameAllocatorFor {
+            using Type = Alloc;
+        };
+#endif
+
+        template<class Alloc>
+        concept FrameAllocatorArg = requires(typename FrameAllocatorFor<std::remove_cvref_t<Alloc>>::Type alloc) {
+            typename FrameAllocatorFor<std::remove_cvref_t<Alloc>>::Type::value_type;
+            alloc.allocate(size_t(1));
+        };
+
+        /**
+         Mixin for promise types that controls allocation of their coroutine frames
+
+         By default frames come from FramePool. If the coroutine's leading parameters are `std::allocator_arg_t, Alloc`
+         (possibly after the object parameter of a member function or lambda) the frame is allocated through
+         `Alloc` instead. `Alloc` can be any allocator or `std::pmr::memory_resource *`.
+
+         Either way a deallocation thunk is stored right after the frame so that `operator delete` knows how
+         to release it.
+         */
+        struct FrameAllocator {
+            static auto operator new(size_t size) -> void * _Nonnull {
+                auto * frame = FramePool::allocate(pooledSize(size));
+                *deallocatorSlot(frame, size) = deallocatePooled;
+                return frame;
+            }
+
+            template<FrameAllocatorArg Alloc, class... Args>
+            static auto operator new(size_t size, std::allocator_arg_t, const Alloc & alloc, const Args & ...) -> void * _Nonnull
+                { return allocateWith(size, alloc); }
+
+            template<class This, FrameAllocatorArg Alloc, class... Args>
+            static auto operator new(size_t size, const This &, std::allocator_arg_t, const Alloc & alloc, const Args & ...) -> void * _Nonnull
+                { return allocateWith(size, alloc); }
+
+            static void operator delete(void * _Nonnull ptr, size_t size) noexcept
+                { (*deallocatorSlot(ptr, size))(ptr, size); }
+
+        private:
+            using Deallocator = void (*)(void * _Nonnull frame, size_t size) noexcept;
+
+            struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) Block {
+                std::byte data[__STDCPP_DEFAULT_NEW_ALIGNMENT__];
+            };
+
+            template<class Alloc>
+            using BlockAllocator = typename std::allocator_traits<typename FrameAllocatorFor<Alloc>::Type>::template rebind_alloc<Block>;
+
+            static constexpr auto alignUp(size_t size, size_t alignment) noexcept -> size_t
+                { return (size + alignment - 1) & ~(alignment - 1); }
+
+            static constexpr auto pooledSize(size_t size) noexcept -> size_t
+                { return alignUp(size, alignof(Deallocator)) + sizeof(Deallocator); }
+
+            static auto deallocatorSlot(void * _Nonnull frame, size_t size) noexcept -> Deallocator * _Nonnull
+                { return reinterpret_cast<Deallocator *>(static_cast<std::byte *>(frame) + alignUp(size, alignof(Deallocator))); }
+
+            template<class Alloc>
+            static constexpr auto allocatorOffset(size_t size) noexcept -> size_t
+                { return alignUp(pooledSize(size), alignof(BlockAllocator<Alloc>)); }
+
+            template<class Alloc>
+            static constexpr auto blockCount(size_t size) noexcept -> size_t
+                { return (allocatorOffset<Alloc>(size) + sizeof(BlockAllocator<Alloc>) + sizeof(Block) - 1) / sizeof(Block); }
+
+            template<class Alloc>
+            static auto allocatorSlot(void * _Nonnull frame, size_t size) noexcept -> BlockAllocator<Alloc> * _Nonnull
+                { return reinterpret_cast<BlockAllocator<Alloc> *>(static_cast<std::byte *>(frame) + allocatorOffset<Alloc>(size)); }
+
+            static void deallocatePooled(void * _Nonnull frame, size_t size) noexcept
+                { FramePool::deallocate(frame, pooledSize(size)); }
+
+            template<class Alloc>
+            static auto allocateWith(size_t size, const Alloc & alloc) -> void * _Nonnull {
+                using Allocator = std::remove_cvref_t<Alloc>;
+                BlockAllocator<Allocator> blockAlloc(alloc);
+                void * frame = std::to_address(std::allocator_traits<BlockAllocator<Allocator>>::allocate(blockAlloc, blockCount<Allocator>(size)));
+                new (allocatorSlot<Allocator>(frame, size)) BlockAllocator<Allocator>(std::move(blockAlloc));
+                *deallocatorSlot(frame, size) = deallocateWith<Allocator>;
+                return frame;
+            }
+
+            template<class Alloc>
+            static void deallocateWith(void * _Nonnull frame, size_t size) noexcept {
+                auto * slot = allocatorSlot<Alloc>(frame, size);
+                BlockAllocator<Alloc> blockAlloc(std::move(*slot));
+                slot->~BlockAllocator<Alloc>();
+                using Pointer = typename std::allocator_traits<BlockAllocator<Alloc>>::pointer;
+                std::allocator_traits<BlockAllocator<Alloc>>::deallocate(blockAlloc,
+                                                                         std::pointer_traits<Pointer>::pointer_to(*static_cast<Block *>(frame)),
+                                                                         blockCount<Alloc>(size));
             }
+        };
+
+        //MARK: - Current queue detection
+        
+        /**
+         Cheap detection of whether we are running on a given queue
+         
+         Apple doesn't allow us to ask "what is the current queue". Instead queues we may need to check against
+         are tagged once with a queue-specific value keyed by the queue's own address, which is then looked up via
+         `dispatch_get_specific`. The lookup reflects whatever the current thread is actually running, including
+         nested `dispatch_sync` and `dispatch_apply` calls, and, like any queue-specific lookup, also finds the tag
+         when the current queue targets the given one. Since every queue has its own key, tags on other queues in
+         the target chain cannot hide it.
+         
+         There is deliberately no thread-local record of the queue we last resumed on: it cannot know about
+         nested dispatches onto other queues, so it would claim we are on a queue we are not.
+         
+         Tagging is on the path of every `resumeOn` so each thread remembers the last queue it tagged. A queue's
+         address can be reused once it is gone so the cache is invalidated whenever any tagged queue is destroyed.
+         */
+        class CurrentQueue {
+        public:
+            static auto is(dispatch_queue_t _Nonnull queue) noexcept -> bool
+                { return dispatch_get_specific(queue) == static_cast<void *>(queue); }
             
-            /**
-             Resumes execution for generators or coroutines that start suspended
-             */
-            auto resumeExecution(dispatch_queue_t _Nullable queue) noexcept {
-                m_value.clear();
-                m_awaiterOnResumeQueue = false;
-                [[maybe_unused]] auto oldstate = m_state.exchange(s_runningMarker, std::memory_order_acq_rel);
-                assert(oldstate != s_runningMarker && oldstate != s_abandonedMarker);
-                auto myHandle = std::coroutine_handle<BasicPromise>::from_promise(*this);
-                if (queue) {
-                    dispatch_async_f(queue, myHandle.address(), [](void * addr) {
-                        std::coroutine_handle<>::from_address(addr).resume();
+            static void tag(dispatch_queue_t _Nonnull queue) noexcept {
+                auto epoch = s_epoch.load(std::memory_order_relaxed);
+                if (t_lastTagged == queue && t_lastTaggedEpoch == epoch)
+                    return;
+                void * value = static_cast<void *>(queue);
+                if (dispatch_queue_get_specific(queue, value) != value) {
+                    dispatch_queue_set_specific(queue, value, value, [](void *) {
+                        s_epoch.fetch_add(1, std::memory_order_relaxed);
                     });
-                } else {
-                    myHandle.resume();
                 }
+                t_lastTagged = queue;
+                t_lastTaggedEpoch = epoch;
             }
             
-            /**
-             Indicates that the client is no longer using this object
-             */
-            void clientAbandon() noexcept {
-                auto oldState = m_state.exchange(s_abandonedMarker, std::memory_order_acquire);
-                assert(oldState != s_abandonedMarker);
-                if (oldState != s_runningMarker)
-                    static_cast<const Derived *>(this)->destroy();
-            }
+        private:
+            static inline std::atomic<unsigned> s_epoch = 0;
+            static inline thread_local dispatch_queue_t _Nullable t_lastTagged = nullptr;
+            static inline thread_local unsigned t_lastTaggedEpoch = 0;
+        };
+        
+        /**
+         Number of workers to spread parallel loops over
+         */
+        inline auto applyConcurrency() noexcept -> size_t {
+            static const size_t value = std::max(std::thread::hardware_concurrency(), 1u);
+            return value;
+        }
+        
+        //MARK: - Cancellation
+        
+        class CancellationRegistration;
+        
+        /**
+         Shared state of a CancellationSource and its tokens
+         
+         Registration and cancellation are rare so a mutex guarding an intrusive list of registrations is
+         sufficient. Registration callbacks are invoked under the lock but they only switch promise states and
+         never run client code. The coroutines they wake up are resumed after the lock is released.
+         */
+        class CancellationState {
+        public:
+            CancellationState() noexcept = default;
+            CancellationState(CancellationState &&) = delete;
             
-            /**
-             Indicates that server has completed processing and is suspended
-             */
-            auto serverComplete() noexcept -> std::coroutine_handle<> {
-                auto oldState = m_state.exchange(s_completedMarker, std::memory_order_acq_rel);
-                assert(oldState != s_completedMarker && oldState != s_notStartedMarker);
-                if (oldState == s_abandonedMarker) {
-                    static_cast<const Derived *>(this)->destroy();
-                } else if (oldState != s_runningMarker) {
-                    if (!m_resumeQueue || isCurrentQueue(m_resumeQueue)) {
-                        return std::coroutine_handle<>::from_address(reinterpret_cast<void *>(oldState));
-                    } else {
-                        resumeHandleAsync(reinterpret_cast<void *>(oldState));
-                    }
-                }
-                return std::noop_coroutine();
+            void addRef() const noexcept
+                { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+            void subRef() const noexcept {
+                if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
             }
             
-            //Client awaiter interface
-            //These methods can only be called when server is known to be suspended
+            auto isCancelled() const noexcept -> bool
+                { return m_cancelled.load(std::memory_order_acquire); }
             
-            /**
-             Moves out stored value at once
-             
-             This is used for coroutines.
-             @pre Value must have been set. If not the call will abort at runtime
-             @return Stored value
-             @throws Stored exception if stored instead of value
-             */
-            decltype(auto) moveOutValue() noexcept(noexcept(m_value.moveOut())) {
-                return m_value.moveOut();
-            }
+            inline void cancel() noexcept;
             
-            /**
-             Get a token that allows later extraction of the value.
-             
-             This is used by generators and is only defined if DelayedValue doesn't store `void`
-             @return A token if the value has been set or nullptr otherwise
-             @throws Stored exception if stored instead of value
-             */
-            decltype(auto) getValueToken() noexcept(noexcept(m_value.getValueToken()))
-            requires(!DelayedValue::isVoid)
-                { return m_value.getValueToken(); }
+        private:
+            friend CancellationRegistration;
             
-            /**
-             Moves out value from previously extracted token.
-             @return Stored value
-             */
-            template<class X=DelayedValue>
-            static decltype(auto) moveOutValue(typename X::ValueToken token) noexcept(noexcept(X::moveOutValue(token)))
-            requires(!DelayedValue::isVoid && std::is_same_v<X, DelayedValue>)
-                { return X::moveOutValue(token); }
+            inline auto add(CancellationRegistration * _Nonnull reg) noexcept -> bool;
+            inline void remove(CancellationRegistration * _Nonnull reg) noexcept;
+            inline void unlink(CancellationRegistration * _Nonnull reg) noexcept;
             
-            //Client awaitable interface
-            //These methods can only be called by client _before_ it awaits
+        private:
+            mutable std::atomic<unsigned> m_refCount = 1;
+            std::atomic<bool> m_cancelled = false;
+            std::mutex m_mutex;
+            CancellationRegistration * _Nullable m_head = nullptr;
+        };
+        
+        /**
+         Intrusive list node linking a promise to CancellationState
+         
+         Like Completion it uses a function pointer rather than a virtual call. The callback returns the
+         coroutine to resume, if any.
+         */
+        class CancellationRegistration {
+        public:
+            using Callback = std::coroutine_handle<> (*)(CancellationRegistration * _Nonnull me) noexcept;
+            
+            CancellationRegistration(Callback _Nonnull callback) noexcept :
+                m_callback(callback)
+            {}
+            ~CancellationRegistration() noexcept
+                { unregister(); }
+            CancellationRegistration(CancellationRegistration &&) = delete;
             
             /**
-             Specify a queue on which resume client
+             @returns false if the state is already cancelled. Nothing is registered in this case.
              */
-            void setResumeQueue(dispatch_queue_t _Nullable queue, dispatch_time_t when) noexcept {
-                m_resumeQueue = queue;
-                m_when = when;
+            auto registerWith(CancellationState * _Nonnull state) noexcept -> bool {
+                assert(!m_state);
+                if (!state->add(this))
+                    return false;
+                m_state = ref(state);
+                return true;
             }
             
+            void unregister() noexcept {
+                if (m_state) {
+                    m_state->remove(this);
+                    m_state.reset();
+                }
+            }
             
-            //Server interface
-            //These methods can only be called when client is known to be suspended
-            
-            template<class... Args>
-            requires(DelayedValue::template IsEmplaceableFrom<Args...>)
-            void emplaceReturnValue(Args && ...args) noexcept(noexcept(m_value.emplaceValue(std::forward<Args>(args)...)))
-                { m_value.emplaceValue(std::forward<Args>(args)...); }
-            
-            void storeException(std::exception_ptr ptr) noexcept
-            requires(DelayedValue::supportsExceptions)
-                { m_value.storeException(ptr); }
+        private:
+            friend CancellationState;
             
-            /**
+            Callback _Nonnull m_callback;
+            RefcntPtr<CancellationState> m_state = noref<CancellationState>(nullptr);
+            CancellationRegistration * _Nullable m_prev = nullptr;
+            CancellationRegistration * _Nullable m_next = nullptr;
+            bool m_linked = false;
+        };
+        
+        inline void CancellationState::cancel() noexcept {
+            if (m_cancelled.exchange(true, std::memory_order_acq_rel))
+                return;
+            for ( ; ; ) {
+                std::coroutine_handle<> next;
+                {
+                    std::lock_guard lock(m_mutex);
+                    auto * reg = m_head;
+                    if (!reg)
+                        break;
+                    unlink(reg);
+                    next = reg->m_callback(reg);
+                }
+                next.resume();
+            }
+        }
+        
+        inline auto CancellationState::add(CancellationRegistration * _Nonnull reg) noexcept -> bool {
+            std::lock_guard lock(m_mutex);
+            //checked under the lock so that cancel() either sees this registration or we see the flag
+            if (m_cancelled.load(std::memory_order_relaxed))
+                return false;
+            reg->m_next = m_head;
+            if (m_head)
+                m_head->m_prev = reg;
+            m_head = reg;
+            reg->m_linked = true;
+            return true;
+        }
+        
+        inline void CancellationState::remove(CancellationRegistration * _Nonnull reg) noexcept {
+            std::lock_guard lock(m_mutex);
+            if (reg->m_linked)
+                unlink(reg);
+        }
+        
+        inline void CancellationState::unlink(CancellationRegistration * _Nonnull reg) noexcept {
+            if (reg->m_prev)
+                reg->m_prev->m_next = reg->m_next;
+            else
+                m_head = reg->m_next;
+            if (reg->m_next)
+                reg->m_next->m_prev = reg->m_prev;
+            reg->m_prev = reg->m_next = nullptr;
+            reg->m_linked = false;
+        }
+        
+        //MARK: - Tracing
+        
+        /**
+         Points in the lifecycle of a coroutine promise recorded when CO_DISPATCH_TRACE is enabled
+         */
+        enum class TraceEventKind : uint8_t {
+            created,
+            started,
+            resumed,
+            yielded,
+            clientSuspended,
+            completed,
+            abandoned,
+            destroyed,
+            resumeScheduled,
+            resumeBegin,
+            resumeEnd
+        };
+        
+#if CO_DISPATCH_TRACE
+        
+        struct TraceEvent {
+            std::chrono::steady_clock::rep time;
+            const void * _Nullable id;
+            TraceEventKind kind;
+        };
+        
+        /**
+         Fixed size piece of a TraceBuffer
+         */
+        struct TraceBlock {
+            static constexpr size_t s_capacity = 4096;
+            
+            std::atomic<size_t> count = 0;
+            std::atomic<TraceBlock *> next = nullptr;
+            TraceEvent events[s_capacity];
+        };
+        
+        /**
+         Per-thread queue of trace events
+         
+         The owning thread appends events without locking, publishing each one with a release store of the block count.
+         A single reader at a time (serialized by TraceRegistry) drains the events and frees the blocks it has finished
+         with. Buffers are never freed so that events of exited threads can still be dumped.
+         */
+        class TraceBuffer {
+            friend class TraceRegistry;
+        public:
+            static auto current() noexcept -> TraceBuffer * _Nullable {
+                if (auto * ret = t_current)
+                    return ret;
+                return create();
+            }
+            
+            void record(TraceEventKind kind, const void * _Nullable id) noexcept {
+                auto count = m_tail->count.load(std::memory_order_relaxed);
+                if (count == TraceBlock::s_capacity) {
+                    auto * block = new (std::nothrow) TraceBlock;
+                    if (!block)
+                        return;
+                    m_tail->next.store(block, std::memory_order_release);
+                    m_tail = block;
+                    count = 0;
+                }
+                m_tail->events[count] = {std::chrono::steady_clock::now().time_since_epoch().count(), id, kind};
+                m_tail->count.store(count + 1, std::memory_order_release);
+            }
+            
+        private:
+            TraceBuffer(TraceBlock * _Nonnull block, unsigned thread) noexcept :
+                m_tail(block),
+                m_head(block),
+                m_thread(thread)
+            {}
+            
+            static auto create() noexcept -> TraceBuffer * _Nullable;
+            
+            template<class Func>
+            void drain(Func && func) {
+                for ( ; ; ) {
+                    auto count = m_head->count.load(std::memory_order_acquire);
+                    for ( ; m_read < count; ++m_read)
+                        func(m_head->events[m_read]);
+                    if (count < TraceBlock::s_capacity)
+                        return;
+                    //a full block is never written again and once next is set the writer has moved on
+                    auto * next = m_head->next.load(std::memory_order_acquire);
+                    if (!next)
+                        return;
+                    delete std::exchange(m_head, next);
+                    m_read = 0;
+                }
+            }
+            
+        private:
+            //writer side
+            TraceBlock * _Nonnull m_tail;
+            //reader side
+            TraceBlock * _Nonnull m_head;
+            size_t m_read = 0;
+            
+            const unsigned m_thread;
+            TraceBuffer * _Nullable m_next = nullptr;
+            
+            static inline thread_local TraceBuffer * _Nullable t_current = nullptr;
+        };
+        
+        /**
+         Process-wide list of TraceBuffers
+         */
+        class TraceRegistry {
+        public:
+            static auto shared() noexcept -> TraceRegistry & {
+                //intentionally leaked so that threads exiting during process shutdown can still record
+                static TraceRegistry * const instance = new TraceRegistry;
+                return *instance;
+            }
+            
+            void add(TraceBuffer * _Nonnull buffer) noexcept {
+                auto * head = m_head.load(std::memory_order_relaxed);
+                do {
+                    buffer->m_next = head;
+                } while (!m_head.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+            }
+            
+            auto nextThreadId() noexcept -> unsigned
+                { return m_threadCount.fetch_add(1, std::memory_order_relaxed) + 1; }
+            
+            /**
+             Removes all events recorded so far and returns them as Chrome trace event format JSON
+             */
+            auto drainJSON() -> std::string {
+                std::lock_guard lock(m_drainMutex);
+                std::string ret = "{\"traceEvents\":[";
+                bool first = true;
+                for (auto * buffer = m_head.load(std::memory_order_acquire); buffer; buffer = buffer->m_next) {
+                    buffer->drain([&](const TraceEvent & event) {
+                        appendJSON(ret, event, buffer->m_thread, first);
+                    });
+                }
+                ret += "],\"displayTimeUnit\":\"ns\"}";
+                return ret;
+            }
+            
+        private:
+            TraceRegistry() noexcept :
+                m_origin(std::chrono::steady_clock::now().time_since_epoch().count())
+            {}
+            
+            void appendJSON(std::string & str, const TraceEvent & event, unsigned thread, bool & first) const {
+                //the "task" span covers the promise lifetime so that it stays balanced for generators that
+                //complete many times or are destroyed mid-sequence.
+                //queue wait time is the async "queued" span, run time is the "run" slice on the thread
+                switch (event.kind) {
+                    case TraceEventKind::created:           appendEvent(str, "task", "b", event, thread, first); break;
+                    case TraceEventKind::started:           appendEvent(str, "started", "n", event, thread, first); break;
+                    case TraceEventKind::resumed:           appendEvent(str, "resumed", "n", event, thread, first); break;
+                    case TraceEventKind::yielded:           appendEvent(str, "yielded", "n", event, thread, first); break;
+                    case TraceEventKind::clientSuspended:   appendEvent(str, "client suspended", "n", event, thread, first); break;
+                    case TraceEventKind::completed:         appendEvent(str, "completed", "n", event, thread, first); break;
+                    case TraceEventKind::abandoned:         appendEvent(str, "abandoned", "n", event, thread, first); break;
+                    case TraceEventKind::destroyed:         appendEvent(str, "task", "e", event, thread, first); break;
+                    case TraceEventKind::resumeScheduled:   appendEvent(str, "queued", "b", event, thread, first); break;
+                    case TraceEventKind::resumeBegin:
+                        appendEvent(str, "queued", "e", event, thread, first);
+                        appendEvent(str, "run", "B", event, thread, first);
+                        break;
+                    case TraceEventKind::resumeEnd:         appendEvent(str, "run", "E", event, thread, first); break;
+                }
+            }
+            
+            void appendEvent(std::string & str, const char * _Nonnull name, const char * _Nonnull phase,
+                             const TraceEvent & event, unsigned thread, bool & first) const {
+                char buf[32];
+                auto number = [&](auto value, int base = 10) -> std::string_view {
+                    auto res = std::to_chars(buf, buf + sizeof(buf), value, base);
+                    return {buf, size_t(res.ptr - buf)};
+                };
+                
+                if (!std::exchange(first, false))
+                    str += ',';
+                str += "{\"name\":\"";
+                str += name;
+                str += "\",\"cat\":\"coroutine\",\"ph\":\"";
+                str += phase;
+                str += "\",\"pid\":1,\"tid\":";
+                str += number(thread);
+                str += ",\"id\":\"0x";
+                str += number(uintptr_t(event.id), 16);
+                //microseconds with nanosecond precision
+                auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::duration(event.time - m_origin)).count();
+                str += "\",\"ts\":";
+                if (nanos < 0) {
+                    str += '-';
+                    nanos = -nanos;
+                }
+                str += number(nanos / 1000);
+                str += '.';
+                auto fraction = number(nanos % 1000 + 1000);
+                str += fraction.substr(1);
+                str += '}';
+            }
+            
+        private:
+            std::atomic<TraceBuffer *> m_head = nullptr;
+            std::atomic<unsigned> m_threadCount = 0;
+            std::mutex m_drainMutex;
+            const std::chrono::steady_clock::rep m_origin;
+        };
+        
+        inline auto TraceBuffer::create() noexcept -> TraceBuffer * _Nullable {
+            auto * block = new (std::nothrow) TraceBlock;
+            if (!block)
+                return nullptr;
+            auto & registry = TraceRegistry::shared();
+            t_current = new (std::nothrow) TraceBuffer(block, registry.nextThreadId());
+            if (!t_current) {
+                delete block;
+                return nullptr;
+            }
+            registry.add(t_current);
+            return t_current;
+        }
+        
+        inline void traceEvent(TraceEventKind kind, const void * _Nullable id) noexcept {
+            if (auto * buffer = TraceBuffer::current())
+                buffer->record(kind, id);
+        }
+        
+#else
+        
+        inline void traceEvent(TraceEventKind, const void * _Nullable) noexcept
+        {}
+        
+#endif
+        
+        //MARK: - Basic Promise
+        
+        /**
+         Non-coroutine continuation of a promise
+         
+         Combinators such as `whenAll` need to be notified of a promise completion without being coroutines themselves.
+         They register a Completion instead of a coroutine handle. The function pointer (rather than a virtual call)
+         is invoked when the server completes and returns the coroutine to transfer control to, if any.
+         */
+        struct Completion {
+            std::coroutine_handle<> (* _Nonnull onComplete)(Completion * _Nonnull me) noexcept;
+        };
+        
+        struct AwaitableAccess;
+        
+        /**
+         Base class for all coroutine promises in this library
+         
+         Provides services for both server and client sides of a coroutine and communication between them.
+         This is the core class of this library. Everything else just wraps its usages. It implements a state
+         machine that tracks client and server behavior to avoid locking.
+         
+         Cancellation is recorded as a flag bit in the same state word. When exceptions are supported a
+         cancellation hands a waiting client back immediately and the server's eventual result is discarded.
+         Otherwise the flag is only a hint for the server to finish early.
+        
+         @tparam Derived the derived class for CRTP
+         @tparam DelayedValue type of ValueCarrier to store asynchronous result
+         */
+        template<class Derived, class DelayedValue>
+        class BasicPromise {
+        public:
+            //Lifecycle
+            
+            /**
+             To be called from `await_ready`
+             @returns Whether the result is already available
+             */
+            auto isReady() const noexcept -> bool {
+                if (m_resumeQueue) {
+                    if (m_when != DISPATCH_TIME_NOW)
+                        return false;
+                    m_awaiterOnResumeQueue = CurrentQueue::is(m_resumeQueue);
+                    if (!m_awaiterOnResumeQueue)
+                        return false;
+                }
+                auto state = m_state.load(std::memory_order_acquire);
+                assert((state & ~s_cancelledFlag) == s_runningMarker || state == s_completedMarker);
+                return !mustWaitForServer(state);
+            }
+            
+            /**
+             To be called from `await_resume`
+             @returns whether the client should remain suspended
+             */
+            auto clientAwait(std::coroutine_handle<> h) noexcept -> bool {
+                auto handleAddr = reinterpret_cast<uintptr_t>(h.address());
+                auto oldState = m_state.load(std::memory_order_acquire);
+                do {
+                    assert(oldState != s_notStartedMarker && oldState != s_abandonedMarker);
+                    if (!mustWaitForServer(oldState)) {
+                        if (m_resumeQueue && !m_awaiterOnResumeQueue) {
+                            resumeHandleAsync(h.address());
+                            return true;
+                        }
+                        return false;
+                    }
+                } while (!m_state.compare_exchange_weak(oldState, handleAddr | (oldState & s_cancelledFlag),
+                                                        std::memory_order_acq_rel, std::memory_order_acquire));
+                traceEvent(TraceEventKind::clientSuspended, this);
+                return true;
+            }
+            
+            /**
+             Alternative to `clientAwait` for clients that are not coroutines
+             
+             The resume queue, if any, is ignored. It is up to the completion to decide where to resume.
+             @returns whether the server is still running and will later invoke the completion
+             */
+            auto clientNotify(Completion * _Nonnull completion) noexcept -> bool {
+                auto tagged = reinterpret_cast<uintptr_t>(completion) | s_completionTag;
+                auto oldState = m_state.load(std::memory_order_acquire);
+                do {
+                    if (!mustWaitForServer(oldState))
+                        return false;
+                } while (!m_state.compare_exchange_weak(oldState, tagged | (oldState & s_cancelledFlag),
+                                                        std::memory_order_acq_rel, std::memory_order_acquire));
+                return true;
+            }
+            
+            /**
+             Version of `clientAbandon` for clients that registered via `clientNotify` and may stop caring before completion
+             
+             @returns whether the registered completion has not been and will never be invoked
+             */
+            auto clientDetach() noexcept -> bool {
+                traceEvent(TraceEventKind::abandoned, this);
+                auto oldState = m_state.exchange(s_abandonedMarker, std::memory_order_acq_rel) & ~s_cancelledFlag;
+                assert(oldState != s_abandonedMarker);
+                if (oldState == s_completedMarker) {
+                    static_cast<const Derived *>(this)->destroy();
+                    return false;
+                }
+                //If the state no longer refers to the completion it has been invoked by cancellation
+                return oldState & s_completionTag;
+            }
+            
+            /**
+             Attaches cancellation state of a token
+             
+             Can only be called by client before it awaits and at most once
+             @throws std::bad_alloc if the registration cannot be allocated
+             */
+            void attachCancellation(CancellationState * _Nullable state) {
+                if (!state)
+                    return;
+                assert(!m_cancellation);
+                m_cancellation = new (FramePool::allocate(sizeof(CancellationLink))) CancellationLink{{CancellationLink::onCancel}, this};
+                if (!m_cancellation->registerWith(state)) {
+                    //nobody can be waiting yet so there is nothing to resume
+                    requestCancellation();
+                }
+            }
+            
+            /**
+             Whether the result is no longer wanted: cancellation has been requested or the client abandoned us
+             
+             Only meaningful for the server while it is running
+             */
+            auto isCancelled() const noexcept -> bool {
+                auto state = m_state.load(std::memory_order_relaxed);
+                return (state & s_cancelledFlag) || state == s_abandonedMarker;
+            }
+            
+            /**
+             Resumes execution for generators or coroutines that start suspended
+             */
+            auto resumeExecution(dispatch_queue_t _Nullable queue) noexcept {
+                m_value.clear();
+                m_awaiterOnResumeQueue = false;
+                [[maybe_unused]] auto oldstate = m_state.exchange(s_runningMarker, std::memory_order_acq_rel);
+                assert(oldstate != s_runningMarker && oldstate != s_abandonedMarker);
+                traceEvent(oldstate == s_notStartedMarker ? TraceEventKind::started : TraceEventKind::resumed, this);
+                auto myHandle = std::coroutine_handle<BasicPromise>::from_promise(*this);
+                if (queue) {
+                    traceEvent(TraceEventKind::resumeScheduled, this);
+                    dispatch_async_f(queue, this, [](void * ctx) {
+                        auto * me = static_cast<BasicPromise *>(ctx);
+                        traceEvent(TraceEventKind::resumeBegin, me);
+                        std::coroutine_handle<BasicPromise>::from_promise(*me).resume();
+                        traceEvent(TraceEventKind::resumeEnd, me);
+                    });
+                } else {
+                    myHandle.resume();
+                }
+            }
+            
+            /**
+             Indicates that the client is no longer using this object
+             */
+            void clientAbandon() noexcept {
+                traceEvent(TraceEventKind::abandoned, this);
+                auto oldState = m_state.exchange(s_abandonedMarker, std::memory_order_acquire) & ~s_cancelledFlag;
+                assert(oldState != s_abandonedMarker);
+                if (oldState != s_runningMarker)
+                    static_cast<const Derived *>(this)->destroy();
+            }
+            
+            /**
+             Indicates that server has completed processing and is suspended
+             */
+            auto serverComplete() noexcept -> std::coroutine_handle<> {
+                traceEvent(TraceEventKind::completed, this);
+                return serverSuspend();
+            }
+            
+            /**
+             Version of `serverComplete` for generators producing an intermediate value
+             */
+            auto serverYield() noexcept -> std::coroutine_handle<> {
+                traceEvent(TraceEventKind::yielded, this);
+                return serverSuspend();
+            }
+            
+            //Client awaiter interface
+            //These methods can only be called when server is known to be suspended
+            
+            /**
+             Moves out stored value at once
+             
+             This is used for coroutines.
+             @pre Value must have been set. If not the call will abort at runtime
+             @return Stored value
+             @throws Stored exception if stored instead of value
+             */
+            decltype(auto) moveOutValue() noexcept(noexcept(m_value.moveOut())) {
+#ifdef __cpp_exceptions
+                if constexpr (s_completesEarlyOnCancel) {
+                    //still flagged rather than completed means we were handed back early
+                    if (m_state.load(std::memory_order_acquire) & s_cancelledFlag)
+                        throw DispatchCancelled();
+                }
+#endif
+                return m_value.moveOut();
+            }
+            
+            /**
+             Get a token that allows later extraction of the value.
+             
+             This is used by generators and is only defined if DelayedValue doesn't store `void`
+             @return A token if the value has been set or nullptr otherwise
+             @throws Stored exception if stored instead of value
+             */
+            decltype(auto) getValueToken() noexcept(noexcept(m_value.getValueToken()))
+            requires(!DelayedValue::isVoid)
+                { return m_value.getValueToken(); }
+            
+            /**
+             Discards the stored value
+             
+             This is used by generators that report the end of their sequence without resuming the coroutine
+             */
+            void clearValue() noexcept
+                { m_value.clear(); }
+            
+            /**
+             Moves out value from previously extracted token.
+             @return Stored value
+             */
+            template<class X=DelayedValue>
+            static decltype(auto) moveOutValue(typename X::ValueToken token) noexcept(noexcept(X::moveOutValue(token)))
+            requires(!DelayedValue::isVoid && std::is_same_v<X, DelayedValue>)
+                { return X::moveOutValue(token); }
+            
+            //Client awaitable interface
+            //These methods can only be called by client _before_ it awaits
+            
+            /**
+             Specify a queue on which resume client
+             */
+            void setResumeQueue(dispatch_queue_t _Nullable queue, dispatch_time_t when) noexcept {
+                m_resumeQueue = queue;
+                m_when = when;
+                if (queue)
+                    CurrentQueue::tag(queue);
+            }
+            
+            
+            //Server interface
+            //These methods can only be called when client is known to be suspended
+            
+            template<class... Args>
+            requires(DelayedValue::template IsEmplaceableFrom<Args...>)
+            void emplaceReturnValue(Args && ...args) noexcept(noexcept(m_value.emplaceValue(std::forward<Args>(args)...)))
+                { m_value.emplaceValue(std::forward<Args>(args)...); }
+            
+            void storeException(std::exception_ptr ptr) noexcept
+            requires(DelayedValue::supportsExceptions)
+                { m_value.storeException(ptr); }
+            
+            /**
              Direct implementation of `unhandled_exception` which is common to all
              derived coroutine promise types
              */
-            void unhandled_exception() noexcept {
-                if constexpr (DelayedValue::supportsExceptions)
-                    m_value.storeException(std::current_exception());
-                else
-                    std::terminate();
+            void unhandled_exception() noexcept {
+                if constexpr (DelayedValue::supportsExceptions)
+                    m_value.storeException(std::current_exception());
+                else
+                    std::terminate();
+            }
+            
+        protected:
+            BasicPromise() noexcept
+                { traceEvent(TraceEventKind::created, this); }
+            BasicPromise(bool running) noexcept :
+                m_state(running ? s_runningMarker : s_notStartedMarker)
+                { traceEvent(TraceEventKind::created, this); }
+            ~BasicPromise() noexcept {
+                //before our members go away since cancellation may be touching them right now
+                if (m_cancellation) {
+                    m_cancellation->~CancellationLink();
+                    FramePool::deallocate(m_cancellation, sizeof(CancellationLink));
+                }
+                traceEvent(TraceEventKind::destroyed, this);
+            }
+            BasicPromise(BasicPromise &&) = delete;
+            
+        private:
+            static constexpr auto mustWaitForServer(uintptr_t state) noexcept -> bool {
+                if (state & s_cancelledFlag)
+                    return !s_completesEarlyOnCancel && (state & ~s_cancelledFlag) == s_runningMarker;
+                return state == s_runningMarker;
+            }
+            
+            auto serverSuspend() noexcept -> std::coroutine_handle<> {
+                auto oldState = m_state.exchange(s_completedMarker, std::memory_order_acq_rel) & ~s_cancelledFlag;
+                assert(oldState != s_completedMarker && oldState != s_notStartedMarker);
+                if (oldState == s_abandonedMarker) {
+                    static_cast<const Derived *>(this)->destroy();
+                } else if (oldState != s_runningMarker) {
+                    return resumeClient(oldState);
+                }
+                return std::noop_coroutine();
+            }
+            
+            auto resumeClient(uintptr_t state) noexcept -> std::coroutine_handle<> {
+                if (state & s_completionTag) {
+                    auto * completion = reinterpret_cast<Completion *>(state & ~s_completionTag);
+                    return completion->onComplete(completion);
+                }
+                if (!m_resumeQueue || CurrentQueue::is(m_resumeQueue))
+                    return std::coroutine_handle<>::from_address(reinterpret_cast<void *>(state));
+                resumeHandleAsync(reinterpret_cast<void *>(state));
+                return std::noop_coroutine();
+            }
+            
+            /**
+             Registration of a promise with the CancellationState of a token
+             
+             Most promises are never given a token so this is allocated on demand rather than embedded in each of them.
+             */
+            struct CancellationLink : CancellationRegistration {
+                BasicPromise * _Nonnull owner;
+                
+                static auto onCancel(CancellationRegistration * _Nonnull reg) noexcept -> std::coroutine_handle<>
+                    { return static_cast<CancellationLink *>(reg)->owner->requestCancellation(); }
+            };
+            
+            auto requestCancellation() noexcept -> std::coroutine_handle<> {
+                auto oldState = m_state.load(std::memory_order_relaxed);
+                uintptr_t newState;
+                do {
+                    assert(oldState != s_notStartedMarker);
+                    if (oldState == s_completedMarker || oldState == s_abandonedMarker || (oldState & s_cancelledFlag))
+                        return std::noop_coroutine();
+                    newState = (s_completesEarlyOnCancel ? s_runningMarker : oldState) | s_cancelledFlag;
+                } while (!m_state.compare_exchange_weak(oldState, newState, std::memory_order_acq_rel, std::memory_order_relaxed));
+                
+                if (!s_completesEarlyOnCancel || oldState == s_runningMarker)
+                    return std::noop_coroutine();
+                return resumeClient(oldState);
+            }
+            
+            void resumeHandleAsync(void * _Nonnull handleAddr) {
+                
+                m_resumee = handleAddr;
+                auto resumer = [](void * ctx) {
+                    //the promise might be gone once the handle is resumed so read everything first
+                    auto * me = static_cast<BasicPromise *>(ctx);
+                    traceEvent(TraceEventKind::resumeBegin, me);
+                    std::coroutine_handle<>::from_address(me->m_resumee).resume();
+                    traceEvent(TraceEventKind::resumeEnd, me);
+                };
+                
+                traceEvent(TraceEventKind::resumeScheduled, this);
+                if (m_when == DISPATCH_TIME_NOW)
+                    dispatch_async_f(m_resumeQueue, this, resumer);
+                else
+                    dispatch_after_f(m_when, m_resumeQueue, this, resumer);
+            }
+            
+        private:
+            static constexpr uintptr_t s_runningMarker = 0;
+            static constexpr uintptr_t s_notStartedMarker = 1;
+            static constexpr uintptr_t s_completedMarker = 2;
+            static constexpr uintptr_t s_abandonedMarker = 3;
+            //Set on Completion pointers stored in the state to distinguish them from coroutine handles.
+            //It can never be confused with the markers above because those are handled first.
+            static constexpr uintptr_t s_completionTag = 1;
+            //Can be combined with running, handle and Completion states. Handles and Completions are at least
+            //8 bytes aligned and the markers above are below 4 so this bit is always free.
+            static constexpr uintptr_t s_cancelledFlag = 4;
+#ifdef __cpp_exceptions
+            static constexpr bool s_completesEarlyOnCancel = DelayedValue::supportsExceptions;
+#else
+            static constexpr bool s_completesEarlyOnCancel = false;
+#endif
+            
+            std::atomic<uintptr_t> m_state = s_runningMarker;
+            QueueHolder m_resumeQueue;
+            dispatch_time_t m_when = DISPATCH_TIME_NOW;
+            mutable bool m_awaiterOnResumeQueue = false;
+            void * _Nullable m_resumee = nullptr;
+            CancellationLink * _Nullable m_cancellation = nullptr;
+            DelayedValue m_value;
+        };
+        
+        template<class Promise>
+        struct PromiseClientAbandoner {
+            void operator()(Promise * _Nonnull ptr) const noexcept
+                { ptr->clientAbandon(); }
+        };
+        template<class Promise>
+        using ClientAbandonPtr = std::unique_ptr<Promise, PromiseClientAbandoner<Promise>>;
+        
+        //MARK: - Common Awaiter
+        
+        template<class Promise>
+        struct Awaiter {
+            ClientAbandonPtr<Promise> promise;
+            
+            auto await_ready() const noexcept -> bool
+                { return promise->isReady(); }
+            auto await_suspend(std::coroutine_handle<> handle) noexcept -> bool
+                { return promise->clientAwait(handle); }
+        };
+        
+    }
+    
+    //MARK: - Cancellation
+    
+    class SleepAwaitable;
+    
+    /**
+     Allows observing cancellation requested via CancellationSource
+     
+     Tokens are cheap to copy. A default constructed token is never cancelled.
+     */
+    class CancellationToken {
+        friend class CancellationSource;
+        friend class SleepAwaitable;
+        template<class Ret, SupportsExceptions E> friend class DispatchTask;
+        template<class T, SupportsExceptions E> friend class DispatchAwaitable;
+    public:
+        CancellationToken() noexcept = default;
+        
+        auto isCancelled() const noexcept -> bool
+            { return m_state && m_state->isCancelled(); }
+        auto canBeCancelled() const noexcept -> bool
+            { return bool(m_state); }
+    private:
+        CancellationToken(Util::CancellationState * _Nonnull state) noexcept :
+            m_state(Util::ref(state))
+        {}
+    private:
+        Util::RefcntPtr<Util::CancellationState> m_state = Util::noref<Util::CancellationState>(nullptr);
+    };
+    
+    /**
+     Requests cancellation of tasks and awaitables associated with its tokens
+     
+     Cancellation is cooperative. Tasks and awaitables with an attached token that have not completed yet are
+     marked as cancelled which callbacks can check via `Promise::isCancelled()`. If exceptions are supported,
+     clients `co_await`ing them are resumed immediately and `co_await` throws DispatchCancelled. The
+     underlying operation keeps running until it finishes and its result is discarded.
+     */
+    class CancellationSource {
+    public:
+        CancellationSource():
+            m_state(Util::noref(new Util::CancellationState))
+        {}
+        
+        auto token() const noexcept -> CancellationToken
+            { return CancellationToken(m_state.get()); }
+        
+        /**
+         Requests cancellation. Only the first call has any effect.
+         
+         Clients that are resumed as a result may run synchronously on the calling thread before this returns
+         unless they specified a resumption queue.
+         */
+        void cancel() const noexcept
+            { m_state->cancel(); }
+        
+        auto isCancelled() const noexcept -> bool
+            { return m_state->isCancelled(); }
+    private:
+        Util::RefcntPtr<Util::CancellationState> m_state;
+    };
+    
+    //MARK: - Async function calls
+    
+    /**
+     Awaitable for asynchronous function calls
+     */
+    template<class T, SupportsExceptions E>
+    class DispatchAwaitable {
+    private:
+        using DelayedValue = Util::ValueCarrier<T, E>;
+        
+        struct State : public Util::BasicPromise<State, DelayedValue> {
+            //Type-erased destruction. The concrete type of the state is only known at creation time
+            //so rather than paying for a vtable we remember how to destroy it.
+            using Destroyer = void (*)(State * _Nonnull) noexcept;
+            
+            State() noexcept :
+                m_destroyer(destroyAs<State>)
+            {}
+            State(Destroyer _Nonnull destroyer) noexcept :
+                m_destroyer(destroyer)
+            {}
+            State(const State &) = delete;
+            
+            void destroy() const noexcept
+                { m_destroyer(const_cast<State *>(this)); }
+            
+            //States are allocated from the recycling pool since there is one for every co_dispatch/makeAwaitable call
+            template<class Derived, class... Args>
+            static auto create(Args && ...args) -> Derived * _Nonnull {
+                void * mem = allocate<Derived>();
+#ifdef __cpp_exceptions
+                if constexpr (!std::is_nothrow_constructible_v<Derived, Args...>) {
+                    try {
+                        return new (mem) Derived(std::forward<Args>(args)...);
+                    } catch (...) {
+                        deallocate<Derived>(mem);
+                        throw;
+                    }
+                }
+#endif
+                return new (mem) Derived(std::forward<Args>(args)...);
+            }
+            
+            template<class Derived>
+            static void destroyAs(State * _Nonnull state) noexcept {
+                auto * derived = static_cast<Derived *>(state);
+                derived->~Derived();
+                deallocate<Derived>(derived);
+            }
+            
+        private:
+            template<class Derived>
+            static auto allocate() -> void * _Nonnull {
+                if constexpr (alignof(Derived) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                    return ::operator new(sizeof(Derived), std::align_val_t(alignof(Derived)));
+                else
+                    return Util::FramePool::allocate(sizeof(Derived));
+            }
+            
+            template<class Derived>
+            static void deallocate(void * _Nonnull ptr) noexcept {
+                if constexpr (alignof(Derived) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                    ::operator delete(ptr, std::align_val_t(alignof(Derived)));
+                else
+                    Util::FramePool::deallocate(ptr, sizeof(Derived));
+            }
+            
+        public:
+            //Reference counting
+            //Unfortunately Promise (below) that will carry state to the clients cannot be move-only
+            //It will likely need to be passed to ObjC blocks that can only capture copyable objects (sigh!).
+            //So we add reference counting here to the State even though it isn't otherwise needed and makes
+            //it less safe.
+            
+            [[clang::always_inline]] void addRef() const noexcept {
+                [[maybe_unused]] auto oldcount = m_refCount.fetch_add(1, std::memory_order_relaxed);
+                assert(oldcount > 0);
+                assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
+            }
+            [[clang::always_inline]] void subRef() const noexcept {
+                auto oldcount = m_refCount.fetch_sub(1, std::memory_order_release);
+                assert(oldcount > 0);
+                if (oldcount == 1)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    //remember, refcounting is for server (Promise) only!
+                    //it is safe to cast in this case because the object is non const to begin with
+                    //and destruction is outside of const-ness purview
+                    auto h = const_cast<State *>(this)->serverComplete();
+                    h.resume();
+                }
+            }
+            
+            mutable std::atomic<unsigned> m_refCount = 1;
+        private:
+            Destroyer _Nonnull m_destroyer;
+        };
+        
+        using ClientStatePtr = Util::ClientAbandonPtr<State>;
+        using AwaiterBase = Util::Awaiter<State>;
+        
+        template<class Func>
+        using FunctionFromReference = std::decay_t<std::remove_cvref_t<Func>>;
+        
+        template<class Func>
+        struct StateForFunc : State {
+            template<class Arg>
+            requires(std::is_constructible_v<Func, Arg &&>)
+            StateForFunc(Arg && arg) noexcept(std::is_nothrow_constructible_v<Func, Arg &&>):
+                State(State::template destroyAs<StateForFunc>),
+                func(std::forward<Arg>(arg))
+            {}
+            
+            template<class Arg>
+            requires(std::is_constructible_v<Func, const Arg &>)
+            StateForFunc(const Arg & arg) noexcept(std::is_nothrow_constructible_v<Func, const Arg &>) :
+                State(State::template destroyAs<StateForFunc>),
+                func(arg)
+            {}
+            
+            Func func;
+        };
+#ifndef __OBJC__
+        template<class Ret>
+        struct StateForFunc<Ret (^)()> : State {
+            StateForFunc(Ret (^ _Nonnull block)()) noexcept:
+                State(State::template destroyAs<StateForFunc>),
+                func(Block_copy(block))
+            {}
+            ~StateForFunc() noexcept
+                { Block_release(func); }
+            StateForFunc(StateForFunc &&) = delete;
+            StateForFunc(const StateForFunc &) = delete;
+            
+            Ret (^ _Nonnull func)();
+        };
+#endif
+        
+        template<class Func>
+        struct StateForApply : State {
+            template<class Arg>
+            StateForApply(Arg && arg, size_t iterations, size_t grain):
+                State(State::template destroyAs<StateForApply>),
+                func(std::forward<Arg>(arg)),
+                iterations(iterations),
+                grain(grain),
+                chunkCount(iterations / grain + (iterations % grain != 0))
+            {}
+            
+            const Func func;
+            const size_t iterations;
+            const size_t grain;
+            const size_t chunkCount;
+            std::atomic<size_t> nextChunk = 0;
+#ifdef __cpp_exceptions
+            std::atomic<bool> failed = false;
+#endif
+        };
+    public:
+        class Promise {
+        public:
+            Promise(State * _Nonnull state):
+                m_sharedState(noref(state))
+            {}
+            
+            //These methods need to be const because promise captured in blocks will be const.
+            //Which means m_sharedState needs to be mutable. Sigh.
+            
+            template<class... Args>
+            requires(DelayedValue::template IsEmplaceableFrom<Args...>)
+            void success(Args && ...args) const noexcept(noexcept(m_sharedState->emplaceReturnValue(std::forward<Args>(args)...))) 
+                { m_sharedState->emplaceReturnValue(std::forward<Args>(args)...); }
+            
+            template<class X=DelayedValue>
+            void success(typename X::MoveInArgType val) const noexcept(noexcept(m_sharedState->emplaceReturnValue(std::forward<decltype(val)>(val))))
+            requires(!DelayedValue::isVoid && std::is_same_v<X, DelayedValue>)
+                { m_sharedState->emplaceReturnValue(std::forward<decltype(val)>(val)); }
+            
+            void failure(std::exception_ptr ptr) const noexcept
+            requires(DelayedValue::supportsExceptions)
+                { m_sharedState->storeException(ptr); }
+            
+            template<class Exc>
+            void failure(Exc && exc) const noexcept
+            requires(DelayedValue::supportsExceptions)
+                { m_sharedState->storeException(std::make_exception_ptr(std::forward<Exc>(exc))); }
+            
+            /**
+             Whether the client requested cancellation via an attached CancellationToken or no longer awaits the result
+             
+             Callbacks can check it to stop early. They still need to call `success` or `failure` eventually.
+             */
+            auto isCancelled() const noexcept -> bool
+                { return m_sharedState->isCancelled(); }
+        private:
+            mutable Util::RefcntPtr<State> m_sharedState;
+        };
+    public:
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && noexcept  {
+            struct awaiter : AwaiterBase {
+                decltype(auto) await_resume() const noexcept(noexcept(AwaiterBase::promise->moveOutValue()))
+                    { return AwaiterBase::promise->moveOutValue(); }
+            };
+            return awaiter{std::move(m_sharedState)};
+        }
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue,
+                      dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchAwaitable && {
+            m_sharedState->setResumeQueue(queue, when);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+        
+        /**
+         Associates this awaitable with a cancellation token
+         
+         Can be called at most once.
+         */
+        auto withCancellation(const CancellationToken & token) && -> DispatchAwaitable && {
+            m_sharedState->attachCancellation(token.m_state.get());
+            return std::move(*this);
+        }
+        
+        template<class Func>
+        requires(std::is_invocable_v<FunctionFromReference<Func>>)
+        static auto invokeOnQueue(dispatch_queue_t _Nonnull queue, Func && func) -> DispatchAwaitable {
+            auto * state = State::template create<StateForFunc<FunctionFromReference<Func>>>(std::forward<Func>(func));
+            dispatch_async_f(queue, state, DispatchAwaitable::invokeFromState<Func>);
+            return DispatchAwaitable(state);
+        }
+        
+        /**
+         Runs func(index) for index in [0, iterations) on the queue in chunks of grain indices
+         
+         Rather than one dispatch per index or a blocking `dispatch_apply` we submit up to one worker per CPU.
+         Workers pull chunks from a shared counter and each holds a server reference to the state so the last
+         one to finish completes it.
+         */
+        template<class Func>
+        requires(DelayedValue::isVoid && std::is_invocable_v<const FunctionFromReference<Func> &, size_t>)
+        static auto invokeApply(dispatch_queue_t _Nonnull queue, size_t iterations, size_t grain, Func && func) -> DispatchAwaitable {
+            using ApplyState = StateForApply<FunctionFromReference<Func>>;
+            auto * state = State::template create<ApplyState>(std::forward<Func>(func), iterations, std::max(grain, size_t(1)));
+            DispatchAwaitable ret(state);
+            auto workers = std::min(state->chunkCount, Util::applyConcurrency());
+            if (workers == 0) {
+                state->subRef();
+                return ret;
+            }
+            //the initial reference goes to the first worker
+            for (size_t i = 1; i < workers; ++i)
+                state->addRef();
+            for (size_t i = 0; i < workers; ++i)
+                dispatch_async_f(queue, state, DispatchAwaitable::applyFromState<ApplyState>);
+            return ret;
+        }
+        
+        template<class Func>
+        requires(std::is_invocable_r_v<void, Func, Promise>)
+        static auto invokeDirectly(Func && func) -> DispatchAwaitable {
+            auto * state = State::template create<State>();
+            DispatchAwaitable ret(state);
+#ifdef __cpp_exceptions
+            try {
+#endif
+                std::forward<Func>(func)(Promise(state));
+
+#ifdef __cpp_exceptions
+            } catch (...) {
+                state->unhandled_exception();
+            }
+#endif
+            return ret;
+        }
+        
+    private:
+        DispatchAwaitable(State * _Nonnull state) noexcept :
+            m_sharedState(state)
+        {}
+        
+        template<class Func>
+        requires(std::is_invocable_v<FunctionFromReference<Func>>)
+        static void invokeFromState(void * _Nonnull ptr) noexcept {
+            auto * state = static_cast<StateForFunc<FunctionFromReference<Func>> *>(ptr);
+            Promise promise(state);
+#ifdef __cpp_exceptions
+            if constexpr (!DelayedValue::supportsExceptions) {
+#endif
+                invoke(state->func, promise);
+#ifdef __cpp_exceptions
+            } else {
+                try {
+                    invoke(state->func, promise);
+                } catch (...) {
+                    promise.failure(std::current_exception());
+                }
+            }
+#endif
+        }
+        
+        template<class ApplyState>
+        static void applyFromState(void * _Nonnull ptr) noexcept {
+            auto * state = static_cast<ApplyState *>(ptr);
+            for ( ; ; ) {
+                auto chunk = state->nextChunk.fetch_add(1, std::memory_order_relaxed);
+                if (chunk >= state->chunkCount)
+                    break;
+                auto first = chunk * state->grain;
+                auto last = std::min(first + state->grain, state->iterations);
+#ifdef __cpp_exceptions
+                if constexpr (DelayedValue::supportsExceptions) {
+                    try {
+                        for (auto i = first; i < last; ++i)
+                            state->func(i);
+                    } catch (...) {
+                        if (!state->failed.exchange(true, std::memory_order_relaxed))
+                            state->storeException(std::current_exception());
+                        //stop handing out chunks to everyone
+                        state->nextChunk.store(state->chunkCount, std::memory_order_relaxed);
+                        break;
+                    }
+                    continue;
+                }
+#endif
+                for (auto i = first; i < last; ++i)
+                    state->func(i);
+            }
+            state->subRef();
+        }
+        
+        template<class Func>
+        requires(std::is_invocable_v<Func>)
+        static void invoke(Func && func, const Promise & promise) noexcept(!DelayedValue::supportsExceptions) {
+            if constexpr (DelayedValue::isVoid) {
+                std::forward<Func>(func)();
+                promise.success();
+            } else {
+                promise.success(std::forward<Func>(func)());
+            }
+        }
+    private:
+        ClientStatePtr m_sharedState;
+        
+        friend Util::AwaitableAccess;
+    };
+    
+    template<class Func, class... Args>
+    using DispatchAwaitableFor = DispatchAwaitable<decltype(std::declval<Func>()(std::declval<Args>()...)),
+#ifdef __cpp_exceptions
+                                                   std::is_nothrow_invocable_v<Func, Args...> ?
+                                                            SupportsExceptions::No :
+                                                            SupportsExceptions::Yes
+#else
+                                                   SupportsExceptions::No
+#endif
+                                 >;
+    
+    
+    
+    /**
+     @function
+     Converts a call with an asynchronous callback to an awaitable call
+     @param func a callable you supply that will eventually cause the promise passed to it to be fulfilled in some callback
+     */
+    template<class Ret, SupportsExceptions E, class Func>
+    requires(std::is_invocable_r_v<void, Func, typename DispatchAwaitable<Ret, E>::Promise>)
+    auto makeAwaitable(Func && func) {
+        return DispatchAwaitable<Ret, E>::invokeDirectly(std::forward<Func>(func));
+    }
+    
+    /**
+     @function
+     Converts a call with an asynchronous callback to an awaitable call
+     
+     This overload uses default value for SupportsExceptions setting. If exceptions are enabled in compilation it supports them
+     otherwise no.
+     @param func a callable you supply that will eventually cause the promise passed to it to be fulfilled in some callback
+     */
+    template<class Ret, class Func>
+    requires(std::is_invocable_r_v<void, Func, typename DispatchAwaitable<Ret, CO_DISPATCH_DEFAULT_SE>::Promise>)
+    auto makeAwaitable(Func && func) {
+        return DispatchAwaitable<Ret, CO_DISPATCH_DEFAULT_SE>::invokeDirectly(std::forward<Func>(func));
+    }
+    
+    
+    /**
+     @function
+     Executes a callable on a queue and makes it awaitable from a coroutine
+     */
+    template<class Func>
+    requires(std::is_invocable_v<Func>)
+    auto co_dispatch(dispatch_queue_t _Nonnull queue, Func && func) {
+        return DispatchAwaitableFor<Func>::invokeOnQueue(queue, std::forward<Func>(func));
+    }
+    
+    /**
+     @function
+     Executes a callable on the main queue and makes it awaitable from a coroutine
+     */
+    template<class Func>
+    requires(std::is_invocable_v<Func>)
+    auto co_dispatch(Func && func) {
+        return co_dispatch(dispatch_get_main_queue(), std::forward<Func>(func));
+    }
+    
+    /**
+     @function
+     Awaitable parallel loop over a queue
+     
+     Invokes `func(index)` for every index in [0, iterations) on the queue, possibly concurrently. Indices are
+     processed in chunks of `grain` consecutive ones, so choose a grain large enough to amortize scheduling
+     and small enough to balance the load. Unlike `dispatch_apply` no thread is blocked while waiting: the
+     awaiting coroutine is resumed once, after all invocations finish.
+     
+     `func` is invoked as const from multiple threads at once and its return value is ignored. If it can
+     throw the first exception stops processing of remaining chunks and is rethrown from `co_await`.
+     */
+    template<class Func>
+    requires(std::is_invocable_v<const std::decay_t<Func> &, size_t>)
+    auto co_dispatch_apply(dispatch_queue_t _Nonnull queue, size_t iterations, Func && func, size_t grain = 1) {
+#ifdef __cpp_exceptions
+        constexpr auto E = std::is_nothrow_invocable_v<const std::decay_t<Func> &, size_t> ? SupportsExceptions::No : SupportsExceptions::Yes;
+#else
+        constexpr auto E = SupportsExceptions::No;
+#endif
+        return DispatchAwaitable<void, E>::invokeApply(queue, iterations, grain, std::forward<Func>(func));
+    }
+    
+#if __cpp_lib_ranges
+    /**
+     @function
+     Awaitable parallel loop over elements of a random access range
+     
+     Invokes `func(element)` for every element of the range. The work starts immediately so the range must remain
+     valid until the operation completes, even if the returned awaitable is abandoned. This is why temporary
+     containers are rejected. Otherwise the same as the index based version.
+     */
+    template<std::ranges::random_access_range Range, class Func>
+    requires(std::ranges::sized_range<Range> && std::ranges::borrowed_range<Range> &&
+             std::is_invocable_v<const std::decay_t<Func> &, std::ranges::range_reference_t<Range>>)
+    auto co_dispatch_apply(dispatch_queue_t _Nonnull queue, Range && range, Func && func, size_t grain = 1) {
+        using Ref = std::ranges::range_reference_t<Range>;
+        constexpr bool isNoexcept = std::is_nothrow_invocable_v<const std::decay_t<Func> &, Ref>;
+        return co_dispatch_apply(queue, size_t(std::ranges::size(range)),
+                                 [first = std::ranges::begin(range), func = std::forward<Func>(func)](size_t i) noexcept(isNoexcept) {
+            func(first[std::ranges::range_difference_t<Range>(i)]);
+        }, grain);
+    }
+#endif
+    
+    //MARK: - Coroutine task
+    
+    /**
+     Return type for coroutines
+     */
+    template<class Ret = void, SupportsExceptions E = CO_DISPATCH_DEFAULT_SE>
+    class DispatchTask
+    {
+    private:
+        using DelayedValue = Util::ValueCarrier<Ret, E>;
+        
+        struct Promise;
+        using BasicPromise = Util::BasicPromise<Promise, DelayedValue>;
+        
+        template<bool IsVoid>
+        struct PromiseBase : BasicPromise {
+            template<class Arg>
+            requires(DelayedValue::template IsEmplaceableFrom<Arg>)
+            void return_value(Arg && arg) noexcept(noexcept(this->emplaceReturnValue(std::forward<Arg>(arg))))
+                { this->emplaceReturnValue(std::forward<Arg>(arg)); }
+        };
+        
+        template<>
+        struct PromiseBase<true> : BasicPromise {
+            void return_void() noexcept
+                { this->emplaceReturnValue(); }
+        };
+        
+        
+        struct Promise : PromiseBase<std::same_as<Ret, void>>, Util::FrameAllocator {
+            auto get_return_object() noexcept -> DispatchTask
+                { return {this}; }
+            auto initial_suspend() noexcept -> std::suspend_never
+                { return {}; }
+            auto final_suspend() noexcept  {
+                struct awaiter {
+                    Promise & me;
+                    constexpr bool await_ready() const noexcept { return false; }
+                    auto await_suspend(std::coroutine_handle<> ) const noexcept
+                        { return me.serverComplete(); }
+                    constexpr void await_resume() const noexcept {}
+                };
+                return awaiter{*this};
+            }
+            
+            void destroy() const noexcept {
+                auto handle = std::coroutine_handle<Promise>::from_promise(const_cast<Promise &>(*this));
+                handle.destroy();
+            }
+        };
+        
+        using AwaiterBase = Util::Awaiter<Promise>;
+        
+    public:
+        using promise_type = Promise;
+        
+    public:
+        DispatchTask(const DispatchTask &) = delete;
+        DispatchTask(DispatchTask &&) noexcept = default;
+        
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored task
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && noexcept  {
+            struct awaiter : AwaiterBase {
+                decltype(auto) await_resume() const noexcept(noexcept(AwaiterBase::promise->moveOutValue()))
+                    { return AwaiterBase::promise->moveOutValue(); }
+            };
+            return awaiter{std::move(m_promise)};
+        }
+        
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchTask && {
+            m_promise->setResumeQueue(queue, when);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchTask &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+        
+        /**
+         Associates this task with a cancellation token
+         
+         The coroutine itself is not interrupted. Pass the token to it if it needs to check for cancellation.
+         Can be called at most once.
+         */
+        auto withCancellation(const CancellationToken & token) && -> DispatchTask && {
+            m_promise->attachCancellation(token.m_state.get());
+            return std::move(*this);
+        }
+        
+    private:
+        DispatchTask(Promise * _Nonnull promise) noexcept :
+            m_promise(promise)
+        {}
+        
+    private:
+        Util::ClientAbandonPtr<Promise> m_promise;
+        
+        friend Util::AwaitableAccess;
+    };
+    
+    //MARK: - Generator
+    
+    template<class T>
+    requires(std::is_nothrow_move_constructible_v<T> && std::is_nothrow_destructible_v<T>)
+    class DispatchChannel;
+    
+    namespace Util {
+        
+        /**
+         Asynchronous iterator shared by generator types
+         
+         Promise must provide `resumeNext(queue)` that either resumes the generator coroutine or, if it has no more
+         values to produce, makes the next await complete with no value.
+         */
+        template<class Promise, class Owner>
+        class GeneratorIterator {
+            friend Owner;
+        private:
+            using AwaiterBase = Awaiter<Promise>;
+            using ValueToken = typename Promise::ValueToken;
+        
+            struct FirstAwaitable {
+                ClientAbandonPtr<Promise> m_promise;
+                QueueHolder m_queue;
+            
+                void operator co_await() & = delete;
+                void operator co_await() const & = delete;
+                auto operator co_await() && noexcept  {
+                    struct awaiter : AwaiterBase {
+                        QueueHolder queue;
+                        auto await_resume() noexcept(noexcept(AwaiterBase::promise->getValueToken())) -> GeneratorIterator {
+                            return GeneratorIterator(std::move(AwaiterBase::promise), queue, AwaiterBase::promise->getValueToken());
+                        }
+                    };
+                    return awaiter{{std::move(m_promise)}, QueueHolder{m_queue}};
+                };
+            };
+            struct NextAwaitable {
+                ClientAbandonPtr<Promise> promise;
+                GeneratorIterator * _Nonnull it;
+            
+                void operator co_await() & = delete;
+                void operator co_await() const & = delete;
+                auto operator co_await() && noexcept  {
+                    struct awaiter : AwaiterBase {
+                        GeneratorIterator * _Nonnull it;
+                        void await_resume() noexcept(noexcept(it->m_promise->getValueToken())) {
+                            it->m_promise = std::move(AwaiterBase::promise);
+                            it->m_valueToken = it->m_promise->getValueToken();
+                        }
+                    };
+                    return awaiter{{std::move(promise)}, it};
+                }
+            };
+        public:
+            GeneratorIterator(GeneratorIterator && src) noexcept = default;
+        
+            decltype(auto) operator*() const noexcept(noexcept(Promise::moveOutValue(m_valueToken)))
+                { return Promise::moveOutValue(m_valueToken); }
+            auto next() noexcept {
+                m_valueToken = nullptr;
+                m_promise->resumeNext(m_queue);
+                return NextAwaitable{{std::move(m_promise)}, this};
+            }
+            operator bool() const noexcept {
+                return m_valueToken;
+            }
+        private:
+            GeneratorIterator(ClientAbandonPtr<Promise> && promise, dispatch_queue_t _Nullable queue, ValueToken valueToken):
+                m_promise(std::move(promise)),
+                m_queue(queue),
+                m_valueToken(valueToken)
+            {}
+        private:
+            ClientAbandonPtr<Promise> m_promise;
+            QueueHolder m_queue;
+            ValueToken m_valueToken;
+        };
+    }
+    
+    /**
+     Return type for generators
+     */
+    template<class Ret, SupportsExceptions E = CO_DISPATCH_DEFAULT_SE>
+    requires(!std::is_void_v<Ret>)
+    class DispatchGenerator
+    {
+    private:
+        using DelayedValue = Util::ValueCarrier<Ret, E>;
+        
+        struct Promise;
+        using BasicPromise = Util::BasicPromise<Promise, DelayedValue>;
+        
+        struct Promise : BasicPromise, Util::FrameAllocator {
+            using ValueToken = typename DelayedValue::ValueToken;
+            
+            Promise() : BasicPromise(false)
+            {}
+            
+            auto get_return_object() noexcept -> DispatchGenerator
+                { return {this}; }
+            auto initial_suspend() noexcept -> std::suspend_always
+                { return {}; }
+            auto final_suspend() noexcept  {
+                struct awaiter {
+                    Promise & me;
+                    constexpr bool await_ready() const noexcept { return false; }
+                    auto await_suspend(std::coroutine_handle<> ) const noexcept
+                        { return me.serverComplete(); }
+                    constexpr void await_resume() const noexcept {}
+                };
+                return awaiter{*this};
+            }
+            
+            template<class Arg>
+            requires(DelayedValue::template IsEmplaceableFrom<Arg>)
+            auto yield_value(Arg && arg) noexcept(noexcept(this->emplaceReturnValue(std::forward<Arg>(arg))))  {
+                this->emplaceReturnValue(std::forward<Arg>(arg));
+                struct awaiter {
+                    Promise & me;
+                    constexpr bool await_ready() const noexcept { return false; }
+                    auto await_suspend(std::coroutine_handle<> ) const noexcept
+                        { return me.serverYield(); }
+                    constexpr void await_resume() const noexcept {}
+                };
+                return awaiter{*this};
+            }
+            
+            void return_void() noexcept 
+            {}
+            
+            void resumeNext(dispatch_queue_t _Nullable queue) noexcept
+                { this->resumeExecution(queue); }
+            
+            void destroy() const noexcept {
+                auto handle = std::coroutine_handle<Promise>::from_promise(const_cast<Promise &>(*this));
+                handle.destroy();
+            }
+        };
+        
+    public:
+        using promise_type = Promise;
+        
+    public:
+        DispatchGenerator(const DispatchGenerator &) = delete;
+        DispatchGenerator(DispatchGenerator &&) noexcept = default;
+        
+        using Iterator = Util::GeneratorIterator<Promise, DispatchGenerator>;
+        
+        auto beginOn(dispatch_queue_t _Nullable queue) && noexcept {
+            m_promise->resumeExecution(queue);
+            return typename Iterator::FirstAwaitable{{std::move(m_promise)}, Util::QueueHolder{queue}};
+        }
+        
+        auto begin() && noexcept
+            { return std::move(*this).beginOn(dispatch_get_main_queue()); }
+        
+        auto beginSync() && noexcept
+            { return std::move(*this).beginOn(nullptr); }
+        
+        auto resumingOn(dispatch_queue_t _Nullable queue) && noexcept -> DispatchGenerator && {
+            m_promise->setResumeQueue(queue, DISPATCH_TIME_NOW);
+            return std::move(*this);
+        }
+        auto resumingOnMainQueue() && noexcept -> DispatchGenerator &&
+            { return std::move(*this).resumingOn(dispatch_get_main_queue()); }
+        
+        /**
+         Makes the generator run ahead of its consumer
+         
+         Returns a generator that produces the same values in the same order. Once iteration begins,
+         this generator is run on the given queue independently of the consumer. Up to `count` values
+         (rounded up to a power of 2 and at least 2) are buffered for the consumer. An exception thrown by
+         this generator is reported after all the values it produced before it. Abandoning the returned
+         generator stops this one at its next `co_yield`.
+         
+         @param queue queue to run this generator on. If nullptr the default priority global queue is used.
+         */
+        auto prefetch(size_t count, dispatch_queue_t _Nullable queue = nullptr) && -> DispatchGenerator
+        requires(!std::is_reference_v<Ret> && std::is_nothrow_move_constructible_v<std::remove_cv_t<Ret>>) {
+            if (!queue)
+                queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+            return prefetched(std::move(*this), count, Util::QueueHolder(queue));
+        }
+    
+    private:
+        DispatchGenerator(Promise * _Nonnull promise) noexcept :
+            m_promise(promise)
+        {}
+        
+        template<class Value>
+        class PrefetchState {
+        public:
+            PrefetchState(size_t count) : m_channel(count)
+            {}
+            
+            void addRef() const noexcept
+                { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+            void subRef() const noexcept {
+                if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+            
+            auto channel() noexcept -> DispatchChannel<Value> &
+                { return m_channel; }
+            
+#ifdef __cpp_exceptions
+            //Only touched by the pump before it closes the channel and by the consumer after it sees it closed
+            std::exception_ptr exception;
+#endif
+        private:
+            mutable std::atomic<unsigned> m_refCount = 1;
+            DispatchChannel<Value> m_channel;
+        };
+        
+        template<class Value>
+        static auto pump(Util::RefcntPtr<PrefetchState<Value>> state, DispatchGenerator source, Util::QueueHolder queue) -> DispatchTask<void, SupportsExceptions::No> {
+#ifdef __cpp_exceptions
+            try {
+#endif
+                for (auto it = co_await std::move(source).beginOn(queue); it; ) {
+                    if (!co_await state->channel().send(*it))
+                        break;
+                    co_await it.next();
+                }
+#ifdef __cpp_exceptions
+            } catch (...) {
+                state->exception = std::current_exception();
+            }
+#endif
+            state->channel().close();
+        }
+        
+        static auto prefetched(DispatchGenerator source, size_t count, Util::QueueHolder queue) -> DispatchGenerator {
+            using Value = std::remove_cv_t<Ret>;
+            auto state = Util::noref(new PrefetchState<Value>(count));
+            //if we are abandoned this makes the pump stop at its next send
+            struct Closer {
+                PrefetchState<Value> & state;
+                ~Closer() noexcept
+                    { state.channel().close(); }
+            } closer{*state};
+            
+            pump(state, std::move(source), std::move(queue));
+            while (auto value = co_await state->channel().receive())
+                co_yield std::move(*value);
+#ifdef __cpp_exceptions
+            if (state->exception)
+                std::rethrow_exception(state->exception);
+#endif
+        }
+        
+    private:
+        Util::ClientAbandonPtr<Promise> m_promise;
+    };
+    
+    /**
+     Return type for generators that hand values to the consumer in batches
+     
+     The coroutine `co_yield`s individual values as with DispatchGenerator but these are collected in a buffer
+     and the coroutine only suspends once the buffer is full. The iterator then produces a `std::span<T>` over
+     the whole batch. The final, possibly partial, batch is produced when the coroutine finishes.
+     
+     This avoids a suspension and a queue hop per value which otherwise dominate the cost of generators
+     producing many small values. The price is latency: values are not seen by the consumer until their
+     batch is complete.
+     
+     The span is only valid until `next()` is called on the iterator. Its elements can be moved from.
+     If the coroutine throws, the values yielded before the exception are produced first and the exception
+     is rethrown from the following `next()`.
+     */
+    template<class T, SupportsExceptions E = CO_DISPATCH_DEFAULT_SE>
+    requires(!std::is_void_v<T> && !std::is_reference_v<T>)
+    class DispatchBatchGenerator
+    {
+    private:
+        using DelayedValue = Util::ValueCarrier<std::span<T>, E>;
+        
+        struct Promise;
+        using BasicPromise = Util::BasicPromise<Promise, DelayedValue>;
+        
+        struct Promise : BasicPromise, Util::FrameAllocator {
+            using ValueToken = typename DelayedValue::ValueToken;
+            
+            Promise() : BasicPromise(false)
+            {}
+            
+            auto get_return_object() noexcept -> DispatchBatchGenerator
+                { return {this}; }
+            auto initial_suspend() noexcept -> std::suspend_always
+                { return {}; }
+            auto final_suspend() noexcept  {
+                struct awaiter {
+                    Promise & me;
+                    constexpr bool await_ready() const noexcept { return false; }
+                    auto await_suspend(std::coroutine_handle<> ) const noexcept {
+                        me.m_finished = true;
+                        if (!me.m_batch.empty())
+                            me.emplaceReturnValue(std::span<T>(me.m_batch));
+                        return me.serverComplete();
+                    }
+                    constexpr void await_resume() const noexcept {}
+                };
+                return awaiter{*this};
+            }
+            
+            template<class Arg>
+            requires(std::is_constructible_v<T, Arg>)
+            auto yield_value(Arg && arg) {
+                if (m_batch.capacity() < m_batchSize)
+                    m_batch.reserve(m_batchSize);
+                m_batch.emplace_back(std::forward<Arg>(arg));
+                struct awaiter {
+                    Promise & me;
+                    auto await_ready() const noexcept -> bool
+                        { return me.m_batch.size() < me.m_batchSize; }
+                    auto await_suspend(std::coroutine_handle<> ) const noexcept {
+                        me.emplaceReturnValue(std::span<T>(me.m_batch));
+                        return me.serverYield();
+                    }
+                    void await_resume() const noexcept {
+                        if (me.m_batch.size() >= me.m_batchSize)
+                            me.m_batch.clear();
+                    }
+                };
+                return awaiter{*this};
+            }
+            
+            void return_void() noexcept
+            {}
+            
+            void unhandled_exception() noexcept {
+#ifdef __cpp_exceptions
+                if constexpr (DelayedValue::supportsExceptions) {
+                    //hand out what we have first
+                    if (!m_batch.empty()) {
+                        m_exception = std::current_exception();
+                        return;
+                    }
+                }
+#endif
+                BasicPromise::unhandled_exception();
+            }
+            
+            void resumeNext(dispatch_queue_t _Nullable queue) noexcept {
+                if (!m_finished) {
+                    this->resumeExecution(queue);
+                    return;
+                }
+                //the final batch has been consumed
+                m_batch.clear();
+                this->clearValue();
+#ifdef __cpp_exceptions
+                if constexpr (DelayedValue::supportsExceptions) {
+                    if (m_exception)
+                        this->storeException(std::exchange(m_exception, nullptr));
+                }
+#endif
+            }
+            
+            void setBatchSize(size_t size) noexcept {
+                assert(size > 0);
+                m_batchSize = size;
+            }
+            
+            void destroy() const noexcept {
+                auto handle = std::coroutine_handle<Promise>::from_promise(const_cast<Promise &>(*this));
+                handle.destroy();
+            }
+            
+        private:
+            std::vector<T> m_batch;
+            size_t m_batchSize = s_defaultBatchSize;
+            bool m_finished = false;
+#ifdef __cpp_exceptions
+            [[no_unique_address]] std::conditional_t<DelayedValue::supportsExceptions, std::exception_ptr, std::monostate> m_exception;
+#endif
+        };
+        
+    public:
+        using promise_type = Promise;
+        
+        static constexpr size_t s_defaultBatchSize = 64;
+        
+    public:
+        DispatchBatchGenerator(const DispatchBatchGenerator &) = delete;
+        DispatchBatchGenerator(DispatchBatchGenerator &&) noexcept = default;
+        
+        using Iterator = Util::GeneratorIterator<Promise, DispatchBatchGenerator>;
+        
+        auto beginOn(dispatch_queue_t _Nullable queue) && noexcept {
+            m_promise->resumeExecution(queue);
+            return typename Iterator::FirstAwaitable{{std::move(m_promise)}, Util::QueueHolder{queue}};
+        }
+        
+        auto begin() && noexcept
+            { return std::move(*this).beginOn(dispatch_get_main_queue()); }
+        
+        auto beginSync() && noexcept
+            { return std::move(*this).beginOn(nullptr); }
+        
+        auto resumingOn(dispatch_queue_t _Nullable queue) && noexcept -> DispatchBatchGenerator && {
+            m_promise->setResumeQueue(queue, DISPATCH_TIME_NOW);
+            return std::move(*this);
+        }
+        auto resumingOnMainQueue() && noexcept -> DispatchBatchGenerator &&
+            { return std::move(*this).resumingOn(dispatch_get_main_queue()); }
+        
+        /**
+         Sets the number of values in each batch. Must be greater than 0. The default is `s_defaultBatchSize`
+         */
+        auto withBatchSize(size_t size) && noexcept -> DispatchBatchGenerator && {
+            m_promise->setBatchSize(size);
+            return std::move(*this);
+        }
+    
+    private:
+        DispatchBatchGenerator(Promise * _Nonnull promise) noexcept :
+            m_promise(promise)
+        {}
+        
+    private:
+        Util::ClientAbandonPtr<Promise> m_promise;
+    };
+    
+    //MARK: - Switching queues
+    
+    namespace Util {
+        
+        struct QueueSwitch {
+            dispatch_queue_t _Nonnull queue;
+            dispatch_time_t when;
+            bool onlyIfNeeded;
+            void * _Nullable handleAddr = nullptr;
+            
+            auto await_ready() noexcept -> bool {
+                if (!onlyIfNeeded)
+                    return false;
+                if (CurrentQueue::is(queue))
+                    return true;
+                //make sure we recognize the queue next time even if we got on it by other means
+                CurrentQueue::tag(queue);
+                return false;
+            }
+            auto await_suspend(std::coroutine_handle<> h) noexcept {
+                handleAddr = h.address();
+                if (when == DISPATCH_TIME_NOW)
+                    dispatch_async_f(queue, this, QueueSwitch::resume);
+                else
+                    dispatch_after_f(when, queue, this, QueueSwitch::resume);
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept
+                {}
+            
+            static void resume(void * _Nonnull ctx) noexcept {
+                //the awaitable lives in the suspended coroutine frame
+                auto * me = static_cast<QueueSwitch *>(ctx);
+                std::coroutine_handle<>::from_address(me->handleAddr).resume();
+            }
+        };
+    }
+    
+    /**
+     @function
+     `co_await`ing this will resume the coroutine on a given queue optionally on or after a given time
+     
+     If you pass your current queue and non default `when` this is equivalent to an asynchronous sleep
+     until `when` - now.
+     */
+    inline auto resumeOn(dispatch_queue_t _Nonnull queue, dispatch_time_t when = DISPATCH_TIME_NOW) noexcept {
+        return Util::QueueSwitch{queue, when, false};
+    }
+    
+    /**
+     @function
+     `co_await`ing this will resume the coroutine on a given queue unless it is already running on it
+     
+     Unlike `resumeOn` this avoids a full enqueue/dequeue when no switch is necessary. Use it when you only
+     care about _where_ the code after `co_await` runs rather than about yielding the queue to other work.
+     */
+    inline auto resumeOnIfNeeded(dispatch_queue_t _Nonnull queue) noexcept {
+        return Util::QueueSwitch{queue, DISPATCH_TIME_NOW, true};
+    }
+    
+    /**
+     @function
+     `co_await`ing this will resume the coroutine on the main queue unless it is already running on it
+     */
+    inline auto resumeOnMainQueueIfNeeded() noexcept {
+        return resumeOnIfNeeded(dispatch_get_main_queue());
+    }
+    
+    /**
+     @function
+     `co_await`ing this will resume a coroutine on the main queue optionally on or after a given time
+     
+     If you are already on the main queue and pass non default  `when` this is equivalent to an asynchronous sleep
+     until `when` - now.
+     */
+    inline auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) noexcept {
+        return resumeOn(dispatch_get_main_queue(), when);
+    }
+    
+    //MARK: - Combinators
+    
+    namespace Util {
+        
+        /**
+         Gives combinators access to the promises inside tasks and awaitables
+         */
+        struct AwaitableAccess {
+            template<class Ret, SupportsExceptions E>
+            static auto takePromise(DispatchTask<Ret, E> && task) noexcept
+                { return std::move(task.m_promise); }
+            template<class Ret, SupportsExceptions E>
+            static auto takePromise(DispatchAwaitable<Ret, E> && awaitable) noexcept
+                { return std::move(awaitable.m_sharedState); }
+        };
+        
+        template<class Awaitable>
+        concept CombinableAwaitable = !std::is_lvalue_reference_v<Awaitable> && requires(Awaitable && awaitable) {
+            AwaitableAccess::takePromise(std::move(awaitable));
+        };
+        
+        template<class Awaitable>
+        using PromisePtrFor = decltype(AwaitableAccess::takePromise(std::declval<Awaitable>()));
+        
+        template<class PromisePtr>
+        using ResultFor = decltype(std::declval<PromisePtr &>()->moveOutValue());
+        
+        template<class PromisePtr>
+        using TupleResultFor = std::conditional_t<std::is_void_v<ResultFor<PromisePtr>>, std::monostate, ResultFor<PromisePtr>>;
+        
+        template<class PromisePtr>
+        auto tupleResultOf(PromisePtr & promise) noexcept(noexcept(promise->moveOutValue())) -> TupleResultFor<PromisePtr> {
+            if constexpr (std::is_void_v<ResultFor<PromisePtr>>) {
+                promise->moveOutValue();
+                return {};
+            } else {
+                return promise->moveOutValue();
+            }
+        }
+        
+        /**
+         Where and when to resume a coroutine awaiting a combinator
+         
+         Mirrors the resumption queue logic of BasicPromise
+         */
+        struct ResumeTarget {
+            QueueHolder queue;
+            dispatch_time_t when = DISPATCH_TIME_NOW;
+            std::coroutine_handle<> handle;
+            
+            /**
+             @returns the handle to resume immediately or noop if it has been scheduled on the queue
+             @note the object must remain alive until the scheduled resumption happens
+             */
+            auto resume() noexcept -> std::coroutine_handle<> {
+                if (!queue || (when == DISPATCH_TIME_NOW && CurrentQueue::is(queue)))
+                    return handle;
+                schedule();
+                return std::noop_coroutine();
+            }
+            
+            /**
+             Like `resume()` but never resumes synchronously
+             
+             For callers that cannot run client code, such as ones holding a lock.
+             @param fallback queue to use if there is no resumption queue
+             */
+            void resumeAsync(dispatch_queue_t _Nonnull fallback) noexcept {
+                if (!queue)
+                    queue = fallback;
+                schedule();
+            }
+            
+        private:
+            void schedule() noexcept {
+                auto resumer = [](void * ctx) {
+                    auto * me = static_cast<ResumeTarget *>(ctx);
+                    me->handle.resume();
+                };
+                if (when == DISPATCH_TIME_NOW)
+                    dispatch_async_f(queue, this, resumer);
+                else
+                    dispatch_after_f(when, queue, this, resumer);
+            }
+        };
+        
+        /**
+         Common machinery of `whenAll` awaiters
+         
+         A single countdown tracks outstanding participants plus one extra count held while registering with them.
+         Whoever brings it to zero resumes the awaiting coroutine, exactly once.
+         */
+        class WhenAllAwaiterBase : private Completion {
+        protected:
+            WhenAllAwaiterBase(size_t count, dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) noexcept :
+                Completion{WhenAllAwaiterBase::onComplete},
+                m_remaining(count + 1),
+                m_resumeTarget{QueueHolder{resumeQueue}, when, {}}
+            {}
+            WhenAllAwaiterBase(WhenAllAwaiterBase &&) = delete;
+            
+            template<class PromisePtr>
+            auto registerWith(const PromisePtr & promise) noexcept -> bool
+                { return promise->clientNotify(this); }
+            
+            auto finishRegistration(std::coroutine_handle<> h, size_t completedSynchronously) noexcept -> bool {
+                m_resumeTarget.handle = h;
+                auto decrement = completedSynchronously + 1;
+                if (m_remaining.fetch_sub(decrement, std::memory_order_acq_rel) != decrement)
+                    return true;
+                return m_resumeTarget.resume() != h;
+            }
+            
+        private:
+            static auto onComplete(Completion * _Nonnull completion) noexcept -> std::coroutine_handle<> {
+                auto * me = static_cast<WhenAllAwaiterBase *>(completion);
+                if (me->m_remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return std::noop_coroutine();
+                return me->m_resumeTarget.resume();
+            }
+            
+        private:
+            std::atomic<size_t> m_remaining;
+            ResumeTarget m_resumeTarget;
+        };
+        
+        template<class Promises>
+        class WhenAllAwaitableBase {
+        public:
+            WhenAllAwaitableBase(Promises && promises) noexcept :
+                m_promises(std::move(promises))
+            {}
+            
+        protected:
+            Promises m_promises;
+            QueueHolder m_resumeQueue;
+            dispatch_time_t m_when = DISPATCH_TIME_NOW;
+        };
+        
+        /**
+         Shared state of a `whenAny` operation
+         
+         Losers may still be invoking their completion after the awaiting coroutine has resumed and moved on, so
+         this state cannot live in the awaiter. It is allocated once per operation together with one completion slot
+         per participant and is refcounted: one reference for the awaiter and one for each participant that may yet
+         invoke its slot.
+         */
+        class WhenAnyState {
+        private:
+            struct Slot : Completion {
+                WhenAnyState * _Nonnull owner;
+                size_t index;
+            };
+        public:
+            static constexpr size_t noWinner = std::numeric_limits<size_t>::max();
+            
+            static auto create(size_t count, dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) -> WhenAnyState * _Nonnull {
+                static_assert(sizeof(WhenAnyState) % alignof(Slot) == 0);
+                auto * me = new (FramePool::allocate(allocationSize(count))) WhenAnyState(count, resumeQueue, when);
+                for (size_t i = 0; i < count; ++i)
+                    new (me->slots() + i) Slot{{WhenAnyState::onComplete}, me, i};
+                return me;
+            }
+            
+            WhenAnyState(WhenAnyState &&) = delete;
+            
+            auto winner() const noexcept -> size_t
+                { return m_winner.load(std::memory_order_acquire); }
+            
+            /**
+             @returns false if the participant had already completed
+             */
+            template<class PromisePtr>
+            auto registerWith(size_t index, const PromisePtr & promise) noexcept -> bool {
+                if (promise->clientNotify(slots() + index))
+                    return true;
+                //No completion will come from this one
+                claimVictory(index);
+                release(1);
+                return false;
+            }
+            
+            auto finishRegistration(std::coroutine_handle<> h) noexcept -> bool {
+                m_resumeTarget.handle = h;
+                if (m_gate.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return true;
+                return m_resumeTarget.resume() != h;
+            }
+            
+            /**
+             Gives up on a participant
+             
+             Must be called for every participant that is not the winner once the awaiter resumes
+             */
+            template<class PromisePtr>
+            void detach(PromisePtr & promise) noexcept {
+                if (promise.release()->clientDetach())
+                    release(1);
+            }
+            
+            void release(size_t count) noexcept {
+                if (m_refs.fetch_sub(count, std::memory_order_acq_rel) != count)
+                    return;
+                auto size = allocationSize(m_count);
+                this->~WhenAnyState();
+                FramePool::deallocate(this, size);
+            }
+            
+        private:
+            WhenAnyState(size_t count, dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) noexcept :
+                m_refs(count + 1),
+                m_count(count),
+                m_resumeTarget{QueueHolder{resumeQueue}, when, {}}
+            {}
+            ~WhenAnyState() noexcept = default;
+            
+            static auto allocationSize(size_t count) noexcept -> size_t
+                { return sizeof(WhenAnyState) + count * sizeof(Slot); }
+            
+            auto slots() noexcept -> Slot * _Nonnull
+                { return reinterpret_cast<Slot *>(this + 1); }
+            
+            /**
+             @returns whether this call made the winner known to both the registering client and the participants
+             */
+            auto claimVictory(size_t index) noexcept -> bool {
+                size_t expected = noWinner;
+                if (!m_winner.compare_exchange_strong(expected, index, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return false;
+                return m_gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            }
+            
+            static auto onComplete(Completion * _Nonnull completion) noexcept -> std::coroutine_handle<> {
+                auto * slot = static_cast<Slot *>(completion);
+                auto * me = slot->owner;
+                auto next = me->claimVictory(slot->index) ? me->m_resumeTarget.resume() : std::noop_coroutine();
+                //If we resume the awaiter it still holds its reference so this cannot be the last one
+                me->release(1);
+                return next;
+            }
+            
+        private:
+            std::atomic<size_t> m_refs;
+            std::atomic<size_t> m_winner = noWinner;
+            //Winner determination + registration completion
+            std::atomic<unsigned> m_gate = 2;
+            size_t m_count;
+            ResumeTarget m_resumeTarget;
+        };
+        
+        /**
+         Owning handle of WhenAnyState held by the awaiter
+         */
+        template<class Promises>
+        class WhenAnyAwaiterBase {
+        protected:
+            WhenAnyAwaiterBase(Promises && promises, size_t count, dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) :
+                promises(std::move(promises)),
+                m_state(WhenAnyState::create(count, resumeQueue, when)),
+                m_count(count)
+            {}
+            WhenAnyAwaiterBase(WhenAnyAwaiterBase &&) = delete;
+            ~WhenAnyAwaiterBase() noexcept {
+                if (!m_registered) {
+                    //participants never saw the state: they hold no references
+                    m_state->release(m_count + 1);
+                    return;
+                }
+                auto winner = m_state->winner();
+                forEach([&](size_t index, auto & promise) {
+                    if (index != winner)
+                        m_state->detach(promise);
+                });
+                m_state->release(1);
+            }
+            
+            auto suspend(std::coroutine_handle<> h) noexcept -> bool {
+                m_registered = true;
+                forEach([&](size_t index, auto & promise) {
+                    m_state->registerWith(index, promise);
+                });
+                return m_state->finishRegistration(h);
+            }
+            
+            auto winner() const noexcept -> size_t
+                { return m_state->winner(); }
+            
+            template<class Func>
+            void forEach(Func && func) noexcept {
+                if constexpr (requires { promises.size(); }) {
+                    for (size_t i = 0; i < promises.size(); ++i)
+                        func(i, promises[i]);
+                } else {
+                    [&]<size_t... Is>(std::index_sequence<Is...>) {
+                        (func(Is, std::get<Is>(promises)), ...);
+                    }(std::make_index_sequence<std::tuple_size_v<Promises>>());
+                }
+            }
+            
+        protected:
+            Promises promises;
+        private:
+            WhenAnyState * _Nonnull m_state;
+            size_t m_count;
+            bool m_registered = false;
+        };
+    }
+    
+    /**
+     Awaitable returned from variadic `whenAll`
+     */
+    template<class... PromisePtrs>
+    class WhenAllAwaitable : private Util::WhenAllAwaitableBase<std::tuple<PromisePtrs...>> {
+    private:
+        using Base = Util::WhenAllAwaitableBase<std::tuple<PromisePtrs...>>;
+        using Result = std::tuple<Util::TupleResultFor<PromisePtrs>...>;
+        static constexpr bool isNoexcept = (noexcept(std::declval<PromisePtrs &>()->moveOutValue()) && ...);
+    public:
+        using Base::Base;
+        
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && noexcept {
+            struct awaiter : Util::WhenAllAwaiterBase {
+                awaiter(WhenAllAwaitable && src) noexcept :
+                    WhenAllAwaiterBase(sizeof...(PromisePtrs), src.m_resumeQueue, src.m_when),
+                    promises(std::move(src.m_promises))
+                {}
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                    size_t completed = std::apply([this](auto & ...promise) {
+                        return (size_t(!this->registerWith(promise)) + ...);
+                    }, promises);
+                    return this->finishRegistration(h, completed);
+                }
+                auto await_resume() noexcept(isNoexcept) -> Result {
+                    return std::apply([](auto & ...promise) {
+                        return Result{Util::tupleResultOf(promise)...};
+                    }, promises);
+                }
+                
+                std::tuple<PromisePtrs...> promises;
+            };
+            return awaiter{std::move(*this)};
+        }
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAllAwaitable && {
+            this->m_resumeQueue = queue;
+            this->m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAllAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+        
+    };
+    
+    /**
+     Awaitable returned from `whenAll` over a vector
+     */
+    template<class PromisePtr>
+    class WhenAllRangeAwaitable : private Util::WhenAllAwaitableBase<std::vector<PromisePtr>> {
+    private:
+        using Base = Util::WhenAllAwaitableBase<std::vector<PromisePtr>>;
+        using Value = Util::ResultFor<PromisePtr>;
+        using Result = std::conditional_t<std::is_void_v<Value>, void, std::vector<Value>>;
+        static constexpr bool isNoexcept = noexcept(std::declval<PromisePtr &>()->moveOutValue());
+    public:
+        using Base::Base;
+        
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && noexcept {
+            struct awaiter : Util::WhenAllAwaiterBase {
+                awaiter(WhenAllRangeAwaitable && src) noexcept :
+                    WhenAllAwaiterBase(src.m_promises.size(), src.m_resumeQueue, src.m_when),
+                    promises(std::move(src.m_promises))
+                {}
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                    size_t completed = 0;
+                    for (auto & promise: promises)
+                        completed += !this->registerWith(promise);
+                    return this->finishRegistration(h, completed);
+                }
+                auto await_resume() noexcept(isNoexcept && std::is_void_v<Value>) -> Result {
+                    if constexpr (std::is_void_v<Value>) {
+                        for (auto & promise: promises)
+                            promise->moveOutValue();
+                    } else {
+                        Result ret;
+                        ret.reserve(promises.size());
+                        for (auto & promise: promises)
+                            ret.push_back(promise->moveOutValue());
+                        return ret;
+                    }
+                }
+                
+                std::vector<PromisePtr> promises;
+            };
+            return awaiter{std::move(*this)};
+        }
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAllRangeAwaitable && {
+            this->m_resumeQueue = queue;
+            this->m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAllRangeAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+    };
+    
+    /**
+     @function
+     Awaits completion of all the given tasks and/or awaitables
+     
+     `co_await`ing the result produces a tuple of all results in order. Results of `void` awaitables are represented
+     by `std::monostate`. If any of the awaitables fails with an exception the first one, in argument order, is rethrown
+     after all complete.
+     
+     Resumption queues set on individual awaitables are ignored. Use `resumeOn` of the result instead.
+     */
+    template<class... Awaitables>
+    requires(sizeof...(Awaitables) > 0 && (Util::CombinableAwaitable<Awaitables> && ...))
+    auto whenAll(Awaitables && ...awaitables) noexcept {
+        return WhenAllAwaitable<Util::PromisePtrFor<Awaitables>...>(
+            std::tuple<Util::PromisePtrFor<Awaitables>...>{Util::AwaitableAccess::takePromise(std::move(awaitables))...}
+        );
+    }
+    
+    /**
+     @function
+     Awaits completion of all tasks or awaitables in a vector
+     
+     `co_await`ing the result produces a vector of all results in order or `void` if the awaitables produce `void`.
+     If any of the awaitables fails with an exception the first one is rethrown after all complete.
+     
+     Resumption queues set on individual awaitables are ignored. Use `resumeOn` of the result instead.
+     */
+    template<class Awaitable>
+    requires(Util::CombinableAwaitable<Awaitable> && !std::is_reference_v<Util::ResultFor<Util::PromisePtrFor<Awaitable>>>)
+    auto whenAll(std::vector<Awaitable> awaitables) {
+        std::vector<Util::PromisePtrFor<Awaitable>> promises;
+        promises.reserve(awaitables.size());
+        for (auto & awaitable: awaitables)
+            promises.push_back(Util::AwaitableAccess::takePromise(std::move(awaitable)));
+        return WhenAllRangeAwaitable<Util::PromisePtrFor<Awaitable>>(std::move(promises));
+    }
+    
+    /**
+     Awaitable returned from variadic `whenAny`
+     */
+    template<class... PromisePtrs>
+    class WhenAnyAwaitable : private Util::WhenAllAwaitableBase<std::tuple<PromisePtrs...>> {
+    private:
+        using Base = Util::WhenAllAwaitableBase<std::tuple<PromisePtrs...>>;
+        using Result = std::variant<Util::TupleResultFor<PromisePtrs>...>;
+        static constexpr bool isNoexcept = (noexcept(std::declval<PromisePtrs &>()->moveOutValue()) && ...);
+    public:
+        using Base::Base;
+        
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && {
+            struct awaiter : Util::WhenAnyAwaiterBase<std::tuple<PromisePtrs...>> {
+                awaiter(WhenAnyAwaitable && src) :
+                    awaiter::WhenAnyAwaiterBase(std::move(src.m_promises), sizeof...(PromisePtrs), src.m_resumeQueue, src.m_when)
+                {}
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool
+                    { return this->suspend(h); }
+                auto await_resume() noexcept(isNoexcept) -> Result {
+                    return [this]<size_t... Is>(std::index_sequence<Is...>) {
+                        using Extractor = Result (*)(std::tuple<PromisePtrs...> &);
+                        constexpr Extractor extractors[] = {
+                            [](std::tuple<PromisePtrs...> & promises) -> Result {
+                                return Result{std::in_place_index<Is>, Util::tupleResultOf(std::get<Is>(promises))};
+                            }...
+                        };
+                        return extractors[this->winner()](this->promises);
+                    }(std::index_sequence_for<PromisePtrs...>());
+                }
+            };
+            return awaiter{std::move(*this)};
+        }
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAnyAwaitable && {
+            this->m_resumeQueue = queue;
+            this->m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAnyAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+    };
+    
+    /**
+     Awaitable returned from `whenAny` over a vector
+     */
+    template<class PromisePtr>
+    class WhenAnyRangeAwaitable : private Util::WhenAllAwaitableBase<std::vector<PromisePtr>> {
+    private:
+        using Base = Util::WhenAllAwaitableBase<std::vector<PromisePtr>>;
+        using Value = Util::ResultFor<PromisePtr>;
+        using Result = std::conditional_t<std::is_void_v<Value>, size_t, std::pair<size_t, Value>>;
+        static constexpr bool isNoexcept = noexcept(std::declval<PromisePtr &>()->moveOutValue());
+    public:
+        using Base::Base;
+        
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && {
+            struct awaiter : Util::WhenAnyAwaiterBase<std::vector<PromisePtr>> {
+                awaiter(WhenAnyRangeAwaitable && src) :
+                    awaiter::WhenAnyAwaiterBase(std::move(src.m_promises), src.m_promises.size(), src.m_resumeQueue, src.m_when)
+                {}
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool
+                    { return this->suspend(h); }
+                auto await_resume() noexcept(isNoexcept) -> Result {
+                    auto winner = this->winner();
+                    if constexpr (std::is_void_v<Value>) {
+                        this->promises[winner]->moveOutValue();
+                        return winner;
+                    } else {
+                        return Result{winner, this->promises[winner]->moveOutValue()};
+                    }
+                }
+            };
+            return awaiter{std::move(*this)};
+        }
+        
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAnyRangeAwaitable && {
+            this->m_resumeQueue = queue;
+            this->m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> WhenAnyRangeAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+    };
+    
+    /**
+     @function
+     Awaits completion of the first of the given tasks and/or awaitables
+     
+     `co_await`ing the result produces a `std::variant` whose active index is the position of the first awaitable to
+     complete and which holds its result. Results of `void` awaitables are represented by `std::monostate`.
+     If the first awaitable to complete fails with an exception it is rethrown.
+     
+     The remaining awaitables are abandoned as if they were destroyed without being awaited: their coroutines or
+     callbacks keep running to completion but their results are discarded.
+     
+     Resumption queues set on individual awaitables are ignored. Use `resumeOn` of the result instead.
+     */
+    template<class... Awaitables>
+    requires(sizeof...(Awaitables) > 0 && (Util::CombinableAwaitable<Awaitables> && ...) &&
+             (!std::is_reference_v<Util::ResultFor<Util::PromisePtrFor<Awaitables>>> && ...))
+    auto whenAny(Awaitables && ...awaitables) noexcept {
+        return WhenAnyAwaitable<Util::PromisePtrFor<Awaitables>...>(
+            std::tuple<Util::PromisePtrFor<Awaitables>...>{Util::AwaitableAccess::takePromise(std::move(awaitables))...}
+        );
+    }
+    
+    /**
+     @function
+     Awaits completion of the first of the tasks or awaitables in a non-empty vector
+     
+     `co_await`ing the result produces a pair of the index of the first awaitable to complete and its result
+     or just the index if the awaitables produce `void`. Exceptions and abandonment of the rest behave as
+     in the variadic `whenAny`.
+     
+     An empty vector has no first awaitable to complete so it is rejected: `std::invalid_argument` is thrown
+     or, if exceptions are disabled, `std::terminate()` is called.
+     */
+    template<class Awaitable>
+    requires(Util::CombinableAwaitable<Awaitable> && !std::is_reference_v<Util::ResultFor<Util::PromisePtrFor<Awaitable>>>)
+    auto whenAny(std::vector<Awaitable> awaitables) {
+        if (awaitables.empty()) {
+#ifdef __cpp_exceptions
+            throw std::invalid_argument("whenAny requires at least one awaitable");
+#else
+            std::terminate();
+#endif
+        }
+        std::vector<Util::PromisePtrFor<Awaitable>> promises;
+        promises.reserve(awaitables.size());
+        for (auto & awaitable: awaitables)
+            promises.push_back(Util::AwaitableAccess::takePromise(std::move(awaitable)));
+        return WhenAnyRangeAwaitable<Util::PromisePtrFor<Awaitable>>(std::move(promises));
+    }
+    
+    //MARK: - Timers
+    
+    namespace Util {
+        
+        class TimerShard;
+        
+        /**
+         Intrusive node of a timer scheduled with TimerWheel
+         
+         The callback is invoked with the shard lock held. Like cancellation callbacks it must only record the
+         outcome and schedule resumption, never run client code or touch the wheel. In exchange, once
+         `TimerWheel::cancel()` returns the callback has either finished or will never run.
+         */
+        struct TimerNode {
+            using Callback = void (*)(TimerNode * _Nonnull me) noexcept;
+            
+            Callback _Nonnull callback;
+            TimerShard * _Nullable shard = nullptr;
+            TimerNode * _Nullable prev = nullptr;
+            TimerNode * _Nullable next = nullptr;
+            uint64_t tick = 0;
+            uint8_t level = 0;
+            uint8_t slot = 0;
+            bool linked = false;
+        };
+        
+        /**
+         Hierarchical timing wheel driven by a single dispatch source timer
+         
+         Timers are kept in 4 levels of 64 slots with 1ms ticks at the bottom level, covering about 4.6 hours.
+         Timers further out are parked in the top level and re-filed when it comes around. Scheduling and
+         cancellation are O(1) and the dispatch source is only re-armed when a new timer is due earlier than
+         anything already scheduled. When the source fires, due slots are visited using per-level occupancy bitmaps
+         so idle stretches cost nothing.
+         
+         Shards live for the duration of the process.
+         */
+        class TimerShard {
+        public:
+            static constexpr uint64_t s_tickNanos = NSEC_PER_MSEC;
+            
+            TimerShard() noexcept :
+                m_queue(dispatch_queue_create("objc-helpers.timers", DISPATCH_QUEUE_SERIAL)),
+                m_source(dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, m_queue)),
+                m_origin(std::chrono::steady_clock::now()) {
+                
+                dispatch_set_context(m_source, this);
+                dispatch_source_set_event_handler_f(m_source, [](void * _Nullable ctx) {
+                    static_cast<TimerShard *>(ctx)->onTimer();
+                });
+                dispatch_source_set_timer(m_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+                dispatch_resume(m_source);
+            }
+            TimerShard(TimerShard &&) = delete;
+            
+            /**
+             Schedules the node to fire no earlier than delay from now
+             
+             Non-zero leeway lets timers with nearby deadlines share a tick. The deadline is rounded up
+             to a multiple of the largest power of 2 ticks not exceeding the leeway.
+             */
+            void schedule(TimerNode * _Nonnull node, std::chrono::nanoseconds delay, std::chrono::nanoseconds leeway) noexcept {
+                auto since = std::chrono::steady_clock::now() - m_origin + std::max(delay, std::chrono::nanoseconds::zero());
+                auto deadline = (uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(since).count()) + s_tickNanos - 1) / s_tickNanos;
+                auto slack = uint64_t(std::max(leeway.count(), decltype(leeway.count())(0))) / s_tickNanos;
+                if (slack > 1)
+                    deadline = (deadline + slack) & ~(std::bit_floor(slack) - 1);
+                
+                std::lock_guard lock(m_mutex);
+                node->shard = this;
+                node->tick = std::max(deadline, m_current);
+                insert(node);
+                ++m_count;
+                if (auto due = dueTick(node); due < m_armedTick)
+                    arm(due);
+            }
+            
+            auto cancel(TimerNode * _Nonnull node) noexcept -> bool {
+                std::lock_guard lock(m_mutex);
+                if (!node->linked)
+                    return false;
+                unlink(node);
+                --m_count;
+                return true;
+            }
+            
+        private:
+            static constexpr unsigned s_levels = 4;
+            static constexpr unsigned s_slotBits = 6;
+            static constexpr unsigned s_slots = 1u << s_slotBits;
+            static constexpr uint64_t s_span = uint64_t(1) << (s_levels * s_slotBits);
+            static constexpr uint64_t s_never = std::numeric_limits<uint64_t>::max();
+            
+            static constexpr auto slotSpan(unsigned level) noexcept -> uint64_t
+                { return uint64_t(1) << (level * s_slotBits); }
+            
+            void insert(TimerNode * _Nonnull node) noexcept {
+                //parks timers beyond the wheel range in the top level, they are re-filed when it is cascaded
+                auto placement = std::min(node->tick, m_current + s_span - 1);
+                auto delta = placement - m_current;
+                unsigned level = 0;
+                while (level < s_levels - 1 && delta >= slotSpan(level + 1))
+                    ++level;
+                unsigned slot = (placement >> (level * s_slotBits)) & (s_slots - 1);
+                
+                auto & head = m_slots[level][slot];
+                node->level = uint8_t(level);
+                node->slot = uint8_t(slot);
+                node->prev = nullptr;
+                node->next = head;
+                if (head)
+                    head->prev = node;
+                head = node;
+                node->linked = true;
+                m_occupied[level] |= uint64_t(1) << slot;
+            }
+            
+            void unlink(TimerNode * _Nonnull node) noexcept {
+                auto & head = m_slots[node->level][node->slot];
+                if (node->prev)
+                    node->prev->next = node->next;
+                else
+                    head = node->next;
+                if (node->next)
+                    node->next->prev = node->prev;
+                if (!head)
+                    m_occupied[node->level] &= ~(uint64_t(1) << node->slot);
+                node->prev = node->next = nullptr;
+                node->linked = false;
+            }
+            
+            /**
+             Tick at which the slot holding the node is next visited
+             */
+            auto dueTick(TimerNode * _Nonnull node) const noexcept -> uint64_t {
+                auto span = slotSpan(node->level);
+                auto base = (m_current + span - 1) & ~(span - 1);
+                auto offset = (node->slot - (base >> (node->level * s_slotBits))) & (s_slots - 1);
+                return base + offset * span;
+            }
+            
+            auto nextDueTick() const noexcept -> uint64_t {
+                auto result = s_never;
+                for (unsigned level = 0; level < s_levels; ++level) {
+                    auto occupied = m_occupied[level];
+                    if (!occupied)
+                        continue;
+                    auto span = slotSpan(level);
+                    auto base = (m_current + span - 1) & ~(span - 1);
+                    auto start = unsigned(base >> (level * s_slotBits)) & (s_slots - 1);
+                    auto offset = unsigned(std::countr_zero(std::rotr(occupied, int(start))));
+                    result = std::min(result, base + offset * span);
+                }
+                return result;
+            }
+            
+            void onTimer() noexcept {
+                auto now = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_origin).count());
+                auto target = now / s_tickNanos;
+                
+                std::lock_guard lock(m_mutex);
+                for ( ; ; ) {
+                    auto due = nextDueTick();
+                    if (due > target)
+                        break;
+                    m_current = due;
+                    for (unsigned level = s_levels - 1; level > 0; --level) {
+                        if (due & (slotSpan(level) - 1))
+                            continue;
+                        auto * node = std::exchange(m_slots[level][(due >> (level * s_slotBits)) & (s_slots - 1)], nullptr);
+                        if (!node)
+                            continue;
+                        m_occupied[level] &= ~(uint64_t(1) << node->slot);
+                        while (node) {
+                            auto * next = node->next;
+                            insert(node);
+                            node = next;
+                        }
+                    }
+                    auto * node = std::exchange(m_slots[0][due & (s_slots - 1)], nullptr);
+                    m_occupied[0] &= ~(uint64_t(1) << (due & (s_slots - 1)));
+                    while (node) {
+                        //the callback may free the node
+                        auto * next = node->next;
+                        node->prev = node->next = nullptr;
+                        node->linked = false;
+                        --m_count;
+                        node->callback(node);
+                        node = next;
+                    }
+                    m_current = due + 1;
+                }
+                m_current = std::max(m_current, target + 1);
+                arm(m_count ? nextDueTick() : s_never);
+            }
+            
+            void arm(uint64_t tick) noexcept {
+                m_armedTick = tick;
+                if (tick == s_never) {
+                    dispatch_source_set_timer(m_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+                    return;
+                }
+                auto deadline = m_origin + std::chrono::nanoseconds(tick * s_tickNanos);
+                auto delay = std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count(),
+                                      decltype(std::chrono::nanoseconds().count())(0));
+                dispatch_source_set_timer(m_source, dispatch_time(DISPATCH_TIME_NOW, int64_t(delay)), DISPATCH_TIME_FOREVER, s_tickNanos);
+            }
+            
+        private:
+            dispatch_queue_t _Nonnull m_queue;
+            dispatch_source_t _Nonnull m_source;
+            const std::chrono::steady_clock::time_point m_origin;
+            std::mutex m_mutex;
+            //all ticks before this one have been processed
+            uint64_t m_current = 0;
+            uint64_t m_armedTick = s_never;
+            size_t m_count = 0;
+            uint64_t m_occupied[s_levels] = {};
+            TimerNode * _Nullable m_slots[s_levels][s_slots] = {};
+        };
+        
+        /**
+         Process-wide set of timer shards
+         
+         A handful of shards, each with its own lock and dispatch source, keeps contention down when a very
+         large number of timers is being scheduled and cancelled from many threads.
+         */
+        class TimerWheel {
+        public:
+            static auto shared() noexcept -> TimerWheel & {
+                //intentionally leaked: timers may still fire during static destruction
+                static TimerWheel * const instance = new TimerWheel;
+                return *instance;
+            }
+            
+            TimerWheel(TimerWheel &&) = delete;
+            
+            void schedule(TimerNode * _Nonnull node, std::chrono::nanoseconds delay, std::chrono::nanoseconds leeway) noexcept {
+                auto index = m_next.fetch_add(1, std::memory_order_relaxed) % m_shardCount;
+                m_shards[index].schedule(node, delay, leeway);
+            }
+            
+            /**
+             @returns true if the node was removed before firing
+             */
+            static auto cancel(TimerNode * _Nonnull node) noexcept -> bool
+                { return node->shard && node->shard->cancel(node); }
+            
+            static auto defaultQueue() noexcept -> dispatch_queue_t _Nonnull
+                { return dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0); }
+            
+        private:
+            static constexpr size_t s_maxShards = 4;
+            
+            TimerWheel():
+                m_shardCount(std::min(s_maxShards, applyConcurrency())),
+                m_shards(new TimerShard[m_shardCount])
+            {}
+            
+        private:
+            const size_t m_shardCount;
+            std::unique_ptr<TimerShard[]> m_shards;
+            std::atomic<size_t> m_next = 0;
+        };
+        
+        /**
+         Awaiter of `sleepFor`
+         
+         Both the timer and the cancellation callbacks run under their respective locks and the destructor takes
+         both, so neither can still be touching the awaiter once it is gone. A gate, as in WhenAnyState, keeps the
+         coroutine from resuming before `await_suspend` is done with the awaiter.
+         */
+        class SleepAwaiter : private TimerNode, private CancellationRegistration {
+        public:
+            SleepAwaiter(std::chrono::nanoseconds duration, std::chrono::nanoseconds leeway,
+                         dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when,
+                         CancellationState * _Nullable cancellation) noexcept :
+                TimerNode{SleepAwaiter::onTimer},
+                CancellationRegistration(SleepAwaiter::onCancel),
+                m_duration(duration),
+                m_leeway(leeway),
+                m_cancellation(ref(cancellation)),
+                m_resumeTarget{QueueHolder{resumeQueue}, when, {}}
+            {}
+            ~SleepAwaiter() noexcept {
+                TimerWheel::cancel(this);
+                this->unregister();
+            }
+            SleepAwaiter(SleepAwaiter &&) = delete;
+            
+            constexpr auto await_ready() const noexcept -> bool
+                { return false; }
+            
+            auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                m_resumeTarget.handle = h;
+                TimerWheel::shared().schedule(this, m_duration, m_leeway);
+                if (m_cancellation && !this->registerWith(m_cancellation.get()))
+                    claim(s_cancelled);
+                if (m_gate.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return true;
+                return m_resumeTarget.resume() != h;
+            }
+            
+            auto await_resume() const noexcept -> bool
+                { return m_outcome.load(std::memory_order_acquire) == s_elapsed; }
+            
+        private:
+            static constexpr unsigned s_pending = 0;
+            static constexpr unsigned s_elapsed = 1;
+            static constexpr unsigned s_cancelled = 2;
+            
+            /**
+             @returns whether the caller must resume the coroutine
+             */
+            auto claim(unsigned outcome) noexcept -> bool {
+                unsigned expected = s_pending;
+                if (!m_outcome.compare_exchange_strong(expected, outcome, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return false;
+                return m_gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
             }
             
-        protected:
-            BasicPromise() = default;
-            BasicPromise(bool running) :
-                m_state(running ? s_runningMarker : s_notStartedMarker)
-            {}
-            ~BasicPromise() noexcept = default;
-            BasicPromise(BasicPromise &&) = delete;
+            static void onTimer(TimerNode * _Nonnull node) noexcept {
+                auto * me = static_cast<SleepAwaiter *>(node);
+                if (me->claim(s_elapsed))
+                    me->m_resumeTarget.resumeAsync(TimerWheel::defaultQueue());
+            }
+            
+            static auto onCancel(CancellationRegistration * _Nonnull reg) noexcept -> std::coroutine_handle<> {
+                auto * me = static_cast<SleepAwaiter *>(reg);
+                if (me->claim(s_cancelled))
+                    return me->m_resumeTarget.resume();
+                return std::noop_coroutine();
+            }
             
         private:
-            //This little trick allows us to detect if current queue is the same as the argument
-            //Since Apple doesn't allow us to ask "what is the current queue" this appears to be
-            //the only way to optimize unnecessary dispatches.
-            //Setting the key is probably not cheap but likely much cheaper than suspending and
-            //scheduling dispatch when none is needed.
-            auto isCurrentQueue(dispatch_queue_t _Nonnull queue) const {
-                dispatch_queue_set_specific(queue, this, const_cast<BasicPromise *>(this), nullptr);
-                bool ret = (dispatch_get_specific(this) == this);
-                dispatch_queue_set_specific(queue, this, nullptr, nullptr);
-                return ret;
+            std::chrono::nanoseconds m_duration;
+            std::chrono::nanoseconds m_leeway;
+            RefcntPtr<CancellationState> m_cancellation;
+            std::atomic<unsigned> m_outcome = s_pending;
+            //outcome determination + await_suspend completion
+            std::atomic<unsigned> m_gate = 2;
+            ResumeTarget m_resumeTarget;
+        };
+        
+        /**
+         Shared state of a `withTimeout` operation
+         
+         The awaited operation may invoke its completion after the awaiting coroutine has resumed and moved on
+         so, like WhenAnyState, this is allocated separately and refcounted: one reference for the awaiter, one
+         for the completion and one for the timer.
+         */
+        class TimeoutState : private Completion, private TimerNode {
+        public:
+            static constexpr unsigned s_pending = 0;
+            static constexpr unsigned s_completed = 1;
+            static constexpr unsigned s_timedOut = 2;
+            
+            static auto create(dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) -> TimeoutState * _Nonnull
+                { return new (FramePool::allocate(sizeof(TimeoutState))) TimeoutState(resumeQueue, when); }
+            
+            TimeoutState(TimeoutState &&) = delete;
+            
+            auto outcome() const noexcept -> unsigned
+                { return m_outcome.load(std::memory_order_acquire); }
+            
+            /**
+             @returns whether the awaiting coroutine must stay suspended
+             */
+            template<class PromisePtr>
+            auto start(const PromisePtr & promise, std::coroutine_handle<> h,
+                       std::chrono::nanoseconds timeout, std::chrono::nanoseconds leeway) noexcept -> bool {
+                m_resumeTarget.handle = h;
+                TimerWheel::shared().schedule(this, timeout, leeway);
+                if (!promise->clientNotify(this)) {
+                    //No completion will come from it
+                    claim(s_completed);
+                    release(1);
+                }
+                if (m_gate.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return true;
+                return m_resumeTarget.resume() != h;
             }
             
-            void resumeHandleAsync(void * _Nonnull handleAddr) {
-                
-                auto resumer = [](void * addr) {
-                    std::coroutine_handle<>::from_address(addr).resume();
-                };
-                
-                if (m_when == DISPATCH_TIME_NOW)
-                    dispatch_async_f(m_resumeQueue, handleAddr, resumer);
-                else
-                    dispatch_after_f(m_when, m_resumeQueue, handleAddr, resumer);
+            /**
+             Gives up on the awaited operation after a timeout
+             */
+            template<class PromisePtr>
+            void detach(PromisePtr & promise) noexcept {
+                if (promise.release()->clientDetach())
+                    release(1);
+            }
+            
+            void release(unsigned count) noexcept {
+                if (m_refs.fetch_sub(count, std::memory_order_acq_rel) != count)
+                    return;
+                this->~TimeoutState();
+                FramePool::deallocate(this, sizeof(TimeoutState));
             }
             
         private:
-            static constexpr uintptr_t s_runningMarker = 0;
-            static constexpr uintptr_t s_notStartedMarker = 1;
-            static constexpr uintptr_t s_completedMarker = 2;
-            static constexpr uintptr_t s_abandonedMarker = 3;
+            TimeoutState(dispatch_queue_t _Nullable resumeQueue, dispatch_time_t when) noexcept :
+                Completion{TimeoutState::onComplete},
+                TimerNode{TimeoutState::onTimer},
+                m_resumeTarget{QueueHolder{resumeQueue}, when, {}}
+            {}
+            ~TimeoutState() noexcept = default;
             
-            std::atomic<uintptr_t> m_state = s_runningMarker;
-            QueueHolder m_resumeQueue;
-            dispatch_time_t m_when = DISPATCH_TIME_NOW;
-            mutable bool m_awaiterOnResumeQueue = false;
-            DelayedValue m_value;
+            /**
+             @returns whether the caller must resume the awaiting coroutine
+             */
+            auto claim(unsigned outcome) noexcept -> bool {
+                unsigned expected = s_pending;
+                if (!m_outcome.compare_exchange_strong(expected, outcome, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return false;
+                if (outcome == s_completed && TimerWheel::cancel(this))
+                    release(1);
+                return m_gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            }
+            
+            static auto onComplete(Completion * _Nonnull completion) noexcept -> std::coroutine_handle<> {
+                auto * me = static_cast<TimeoutState *>(completion);
+                auto next = me->claim(s_completed) ? me->m_resumeTarget.resume() : std::noop_coroutine();
+                //If we resume the awaiter it still holds its reference so this cannot be the last one
+                me->release(1);
+                return next;
+            }
+            
+            static void onTimer(TimerNode * _Nonnull node) noexcept {
+                auto * me = static_cast<TimeoutState *>(node);
+                if (me->claim(s_timedOut))
+                    me->m_resumeTarget.resumeAsync(TimerWheel::defaultQueue());
+                me->release(1);
+            }
+            
+        private:
+            std::atomic<unsigned> m_refs = 3;
+            std::atomic<unsigned> m_outcome = s_pending;
+            //outcome determination + registration completion
+            std::atomic<unsigned> m_gate = 2;
+            ResumeTarget m_resumeTarget;
         };
+    }
+    
+    /**
+     Awaitable returned from `sleepFor`
+     */
+    class SleepAwaitable {
+    public:
+        SleepAwaitable(std::chrono::nanoseconds duration, std::chrono::nanoseconds leeway) noexcept :
+            m_duration(duration),
+            m_leeway(leeway)
+        {}
         
-        template<class Promise>
-        struct PromiseClientAbandoner {
-            void operator()(Promise * _Nonnull ptr) const noexcept
-                { ptr->clientAbandon(); }
-        };
-        template<class Promise>
-        using ClientAbandonPtr = std::unique_ptr<Promise, PromiseClientAbandoner<Promise>>;
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && noexcept {
+            return Util::SleepAwaiter(m_duration, m_leeway, m_resumeQueue, m_when, m_cancellation.get());
+        }
         
-        //MARK: - Common Awaiter
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> SleepAwaitable && {
+            m_resumeQueue = queue;
+            m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> SleepAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
         
-        template<class Promise>
-        struct Awaiter {
-            ClientAbandonPtr<Promise> promise;
-            
-            auto await_ready() const noexcept -> bool
-                { return promise->isReady(); }
-            auto await_suspend(std::coroutine_handle<> handle) noexcept -> bool
-                { return promise->clientAwait(handle); }
-        };
+        /**
+         Allows the sleep to be cut short by a cancellation token
+         
+         Can be called at most once.
+         */
+        auto withCancellation(const CancellationToken & token) && noexcept -> SleepAwaitable && {
+            m_cancellation = token.m_state;
+            return std::move(*this);
+        }
         
-    }
+    private:
+        std::chrono::nanoseconds m_duration;
+        std::chrono::nanoseconds m_leeway;
+        Util::QueueHolder m_resumeQueue;
+        dispatch_time_t m_when = DISPATCH_TIME_NOW;
+        Util::RefcntPtr<Util::CancellationState> m_cancellation = Util::noref<Util::CancellationState>(nullptr);
+    };
     
-    //MARK: - Async function calls
+    /**
+     @function
+     `co_await`ing this suspends the coroutine for at least the given duration
+     
+     Unlike `resumeOn` with a `when` argument this does not queue a separate `dispatch_after` for each sleeper.
+     All sleeps and `withTimeout` deadlines are multiplexed over a few shared timer wheels with millisecond
+     resolution, so having hundreds of thousands of them pending at once is cheap.
+     
+     Non-zero leeway allows the wakeup to be delayed by up to that much so that it can be batched with others.
+     
+     `co_await` produces `true` if the full duration has elapsed and `false` if the sleep was cancelled via
+     `withCancellation`. By default the coroutine is resumed on the global concurrent queue of default priority
+     if the timer expires and synchronously by the cancelling thread on cancellation. Use `resumeOn` to pick a queue.
+     */
+    inline auto sleepFor(std::chrono::nanoseconds duration, std::chrono::nanoseconds leeway = {}) noexcept {
+        return SleepAwaitable(duration, leeway);
+    }
     
     /**
-     Awaitable for asynchronous function calls
+     Awaitable returned from `withTimeout`
      */
-    template<class T, SupportsExceptions E>
-    class DispatchAwaitable {
+    template<class PromisePtr>
+    class TimeoutAwaitable {
     private:
-        using DelayedValue = Util::ValueCarrier<T, E>;
+        using Value = Util::ResultFor<PromisePtr>;
+        using Result = std::conditional_t<std::is_void_v<Value>, bool, std::optional<Value>>;
+        static constexpr bool isNoexcept = noexcept(std::declval<PromisePtr &>()->moveOutValue());
+    public:
+        TimeoutAwaitable(PromisePtr && promise, std::chrono::nanoseconds timeout, std::chrono::nanoseconds leeway) noexcept :
+            m_promise(std::move(promise)),
+            m_timeout(timeout),
+            m_leeway(leeway)
+        {}
         
-        struct State : public Util::BasicPromise<State, DelayedValue> {
-            void destroy() const noexcept
-                { delete this; }
-            virtual ~State()
+        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
+        void operator co_await() & = delete;
+        void operator co_await() const & = delete;
+        auto operator co_await() && {
+            class awaiter {
+            public:
+                awaiter(TimeoutAwaitable && src) :
+                    m_promise(std::move(src.m_promise)),
+                    m_state(Util::TimeoutState::create(src.m_resumeQueue, src.m_when)),
+                    m_timeout(src.m_timeout),
+                    m_leeway(src.m_leeway)
                 {}
-            
-            //Reference counting
-            //Unfortunately Promise (below) that will carry state to the clients cannot be move-only
-            //It will likely need to be passed to ObjC blocks that can only capture copyable objects (sigh!).
-            //So we add reference counting here to the State even though it isn't otherwise needed and makes
-            //it less safe.
-            
-            [[clang::always_inline]] void addRef() const noexcept {
-                [[maybe_unused]] auto oldcount = m_refCount.fetch_add(1, std::memory_order_relaxed);
-                assert(oldcount > 0);
-                assert(oldcount < std::numeric_limits<decltype(oldcount)>::max());
-            }
-            [[clang::always_inline]] void subRef() const noexcept {
-                auto oldcount = m_refCount.fetch_sub(1, std::memory_order_release);
-                assert(oldcount > 0);
-                if (oldcount == 1)
-                {
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    //remember, refcounting is for server (Promise) only!
-                    //it is safe to cast in this case because the object is non const to begin with
-                    //and destruction is outside of const-ness purview
-                    auto h = const_cast<State *>(this)->serverComplete();
-                    h.resume();
+                awaiter(awaiter &&) = delete;
+                ~awaiter() noexcept {
+                    if (!m_started) {
+                        //neither the timer nor the promise saw the state
+                        m_state->release(3);
+                        return;
+                    }
+                    if (m_state->outcome() == Util::TimeoutState::s_timedOut)
+                        m_state->detach(m_promise);
+                    m_state->release(1);
                 }
-            }
-            
-            mutable std::atomic<unsigned> m_refCount = 1;
-        };
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                    m_started = true;
+                    return m_state->start(m_promise, h, m_timeout, m_leeway);
+                }
+                auto await_resume() noexcept(isNoexcept) -> Result {
+                    if (m_state->outcome() == Util::TimeoutState::s_timedOut)
+                        return Result{};
+                    if constexpr (std::is_void_v<Value>) {
+                        m_promise->moveOutValue();
+                        return true;
+                    } else {
+                        return Result{m_promise->moveOutValue()};
+                    }
+                }
+            private:
+                PromisePtr m_promise;
+                Util::TimeoutState * _Nonnull m_state;
+                std::chrono::nanoseconds m_timeout;
+                std::chrono::nanoseconds m_leeway;
+                bool m_started = false;
+            };
+            return awaiter{std::move(*this)};
+        }
         
-        using ClientStatePtr = Util::ClientAbandonPtr<State>;
-        using AwaiterBase = Util::Awaiter<State>;
+        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> TimeoutAwaitable && {
+            m_resumeQueue = queue;
+            m_when = when;
+            if (queue)
+                Util::CurrentQueue::tag(queue);
+            return std::move(*this);
+        }
+        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> TimeoutAwaitable &&
+            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
         
-        template<class Func>
-        using FunctionFromReference = std::decay_t<std::remove_cvref_t<Func>>;
+    private:
+        PromisePtr m_promise;
+        std::chrono::nanoseconds m_timeout;
+        std::chrono::nanoseconds m_leeway;
+        Util::QueueHolder m_resumeQueue;
+        dispatch_time_t m_when = DISPATCH_TIME_NOW;
+    };
+    
+    /**
+     @function
+     Awaits a task or awaitable for at most the given duration
+     
+     `co_await`ing the result produces a `std::optional` holding the result of the awaitable if it completed in time
+     and an empty one if the timeout expired first. For `void` awaitables it produces `true` or `false` respectively.
+     If the awaitable completes in time with an exception it is rethrown.
+     
+     On timeout the awaitable is abandoned as if it was destroyed without being awaited: it keeps running to
+     completion, observing itself as cancelled, but its result is discarded. Timeouts share the timer wheels
+     of `sleepFor` and `leeway` has the same meaning.
+     
+     Resumption queue set on the awaitable is ignored. Use `resumeOn` of the result instead. If the timeout
+     expires and no queue is given the coroutine is resumed on the global concurrent queue of default priority.
+     */
+    template<class Awaitable>
+    requires(Util::CombinableAwaitable<Awaitable> && !std::is_reference_v<Util::ResultFor<Util::PromisePtrFor<Awaitable>>>)
+    auto withTimeout(Awaitable && awaitable, std::chrono::nanoseconds timeout, std::chrono::nanoseconds leeway = {}) noexcept {
+        return TimeoutAwaitable<Util::PromisePtrFor<Awaitable>>(Util::AwaitableAccess::takePromise(std::move(awaitable)),
+                                                                timeout, leeway);
+    }
+    
+    //MARK: - Task groups
+    
+    /**
+     Runs child tasks on a queue with a limit on how many are in flight at once
+     
+     Children are spawned by `co_await group.spawn(func)` where `func` is a callable returning a `DispatchTask` or
+     `DispatchAwaitable`, optionally taking a CancellationToken. It is invoked on the group's queue once a slot is
+     available. Until then the spawning coroutine remains suspended which provides back-pressure.
+     
+     `co_await group.join()` waits for all children to finish. If any child fails with an exception the group is
+     cancelled: children still waiting to be spawned are dropped, running ones can observe the token passed to
+     them and `join` rethrows the first exception once all running children finish.
+     
+     A spawning or joining coroutine that had to wait is resumed on the queue given to `resumeOn` of the awaitable
+     or, if there is none, asynchronously on the group's queue. It is never resumed inline by a finishing child.
+     */
+    class DispatchTaskGroup {
+    private:
+        struct SpawnWaiter {
+            SpawnWaiter * _Nullable next = nullptr;
+            Util::ResumeTarget target;
+            bool admitted = false;
+        };
         
-        template<class Func>
-        struct StateForFunc : State {
-            template<class Arg>
-            requires(std::is_constructible_v<Func, Arg &&>)
-            StateForFunc(Arg && arg) noexcept(std::is_nothrow_constructible_v<Func, Arg &&>):
-                func(std::forward<Arg>(arg))
-            {}
+        /**
+         Shared between the group object and its running children so that the group can be
+         safely destroyed without being joined
+         */
+        class State {
+        public:
+            State(dispatch_queue_t _Nonnull queue, size_t maxInFlight) :
+                m_queue(queue),
+                m_maxInFlight(maxInFlight)
+            {
+                assert(maxInFlight > 0);
+            }
+            State(State &&) = delete;
             
-            template<class Arg>
-            requires(std::is_constructible_v<Func, const Arg &>)
-            StateForFunc(const Arg & arg) noexcept(std::is_nothrow_constructible_v<Func, const Arg &>) :
-                func(arg)
-            {}
+            void addRef() const noexcept
+                { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+            void subRef() const noexcept {
+                if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
             
-            Func func;
-        };
-#ifndef __OBJC__
-        template<class Ret>
-        struct StateForFunc<Ret (^)()> : State {
-            StateForFunc(Ret (^ _Nonnull block)()) noexcept:
-                func(Block_copy(block))
-            {}
-            ~StateForFunc() noexcept
-                { Block_release(func); }
-            StateForFunc(StateForFunc &&) = delete;
-            StateForFunc(const StateForFunc &) = delete;
+            auto queue() const noexcept -> dispatch_queue_t _Nonnull
+                { return m_queue; }
+            auto cancellation() const noexcept -> const CancellationSource &
+                { return m_cancellation; }
             
-            Ret (^ _Nonnull func)();
-        };
-#endif
-    public:
-        class Promise {
-        public:
-            Promise(State * _Nonnull state):
-                m_sharedState(noref(state))
-            {}
+            /**
+             @returns whether the caller has to wait for a slot. If not `waiter.admitted` says whether
+             it got one.
+             */
+            auto tryAdmit(SpawnWaiter & waiter) -> bool {
+                std::lock_guard lock(m_mutex);
+                if (m_cancellation.isCancelled()) {
+                    waiter.admitted = false;
+                    return false;
+                }
+                if (m_inFlight < m_maxInFlight) {
+                    ++m_inFlight;
+                    waiter.admitted = true;
+                    return false;
+                }
+                if (m_lastWaiter)
+                    m_lastWaiter->next = &waiter;
+                else
+                    m_firstWaiter = &waiter;
+                m_lastWaiter = &waiter;
+                return true;
+            }
             
-            //These methods need to be const because promise captured in blocks will be const.
-            //Which means m_sharedState needs to be mutable. Sigh.
+            auto tryJoin(Util::ResumeTarget & joiner) -> bool {
+                std::lock_guard lock(m_mutex);
+                if (m_inFlight == 0 && !m_firstWaiter)
+                    return false;
+                assert(!m_joiner);
+                m_joiner = &joiner;
+                return true;
+            }
             
-            template<class... Args>
-            requires(DelayedValue::template IsEmplaceableFrom<Args...>)
-            void success(Args && ...args) const noexcept(noexcept(m_sharedState->emplaceReturnValue(std::forward<Args>(args)...))) 
-                { m_sharedState->emplaceReturnValue(std::forward<Args>(args)...); }
+            /**
+             Called when a child finishes. Hands its slot to the next waiting spawner, if any.
+             */
+            void release() {
+                for ( ; ; ) {
+                    Util::ResumeTarget * next = nullptr;
+                    bool done = true;
+                    {
+                        std::lock_guard lock(m_mutex);
+                        if (auto * waiter = m_firstWaiter) {
+                            m_firstWaiter = waiter->next;
+                            if (!m_firstWaiter)
+                                m_lastWaiter = nullptr;
+                            //when cancelled keep waking up waiters without handing them our slot
+                            waiter->admitted = !m_cancellation.isCancelled();
+                            done = waiter->admitted;
+                            next = &waiter->target;
+                        } else {
+                            if (--m_inFlight == 0)
+                                next = std::exchange(m_joiner, nullptr);
+                        }
+                    }
+                    //we are at the end of a child so never resume inline unless already on the requested queue
+                    if (next) {
+                        if (next->queue)
+                            next->resume().resume();
+                        else
+                            next->resumeAsync(m_queue);
+                    }
+                    if (done)
+                        return;
+                }
+            }
             
-            template<class X=DelayedValue>
-            void success(typename X::MoveInArgType val) const noexcept(noexcept(m_sharedState->emplaceReturnValue(std::forward<decltype(val)>(val))))
-            requires(!DelayedValue::isVoid && std::is_same_v<X, DelayedValue>)
-                { m_sharedState->emplaceReturnValue(std::forward<decltype(val)>(val)); }
+#ifdef __cpp_exceptions
+            void fail(std::exception_ptr ex) noexcept {
+                {
+                    std::lock_guard lock(m_mutex);
+                    if (!m_exception)
+                        m_exception = ex;
+                }
+                m_cancellation.cancel();
+            }
             
-            void failure(std::exception_ptr ptr) const noexcept
-            requires(DelayedValue::supportsExceptions)
-                { m_sharedState->storeException(ptr); }
+            void rethrowIfFailed() {
+                std::exception_ptr ex;
+                {
+                    std::lock_guard lock(m_mutex);
+                    ex = std::exchange(m_exception, nullptr);
+                }
+                if (ex)
+                    std::rethrow_exception(ex);
+            }
+#endif
             
-            template<class Exc>
-            void failure(Exc && exc) const noexcept
-            requires(DelayedValue::supportsExceptions)
-                { m_sharedState->storeException(std::make_exception_ptr(std::forward<Exc>(exc))); }
         private:
-            mutable Util::RefcntPtr<State> m_sharedState;
+            mutable std::atomic<unsigned> m_refCount = 1;
+            Util::QueueHolder m_queue;
+            size_t m_maxInFlight;
+            CancellationSource m_cancellation;
+            std::mutex m_mutex;
+            size_t m_inFlight = 0;
+            SpawnWaiter * _Nullable m_firstWaiter = nullptr;
+            SpawnWaiter * _Nullable m_lastWaiter = nullptr;
+            Util::ResumeTarget * _Nullable m_joiner = nullptr;
+#ifdef __cpp_exceptions
+            std::exception_ptr m_exception;
+#endif
         };
-    public:
-        //You must use a temporary to co_await or do co_await std::move(...) on a stored awaitable
-        void operator co_await() & = delete;
-        void operator co_await() const & = delete;
-        auto operator co_await() && noexcept  {
-            struct awaiter : AwaiterBase {
-                decltype(auto) await_resume() const noexcept(noexcept(AwaiterBase::promise->moveOutValue()))
-                    { return AwaiterBase::promise->moveOutValue(); }
-            };
-            return awaiter{std::move(m_sharedState)};
-        }
-        
-        auto resumeOn(dispatch_queue_t _Nullable queue,
-                      dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchAwaitable && {
-            m_sharedState->setResumeQueue(queue, when);
-            return std::move(*this);
-        }
-        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchAwaitable &&
-            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
         
         template<class Func>
-        requires(std::is_invocable_v<FunctionFromReference<Func>>)
-        static auto invokeOnQueue(dispatch_queue_t _Nonnull queue, Func && func) -> DispatchAwaitable {
-            auto * state = new StateForFunc<FunctionFromReference<Func>>(std::forward<Func>(func));
-            dispatch_async_f(queue, state, DispatchAwaitable::invokeFromState<Func>);
-            return DispatchAwaitable(state);
-        }
+        static constexpr bool takesToken = std::is_invocable_v<Func, CancellationToken>;
+        
+    public:
+        /**
+         @param queue queue to run children on
+         @param maxInFlight maximum number of children running at once. Must be greater than 0
+         */
+        DispatchTaskGroup(dispatch_queue_t _Nonnull queue, size_t maxInFlight):
+            m_state(Util::noref(new State(queue, maxInFlight)))
+        {}
+        DispatchTaskGroup(const DispatchTaskGroup &) = delete;
+        DispatchTaskGroup & operator=(const DispatchTaskGroup &) = delete;
         
+        /**
+         Starts a child once there is a free slot
+         
+         The returned object must be `co_await`ed for anything to happen. It completes once the child has been
+         started or dropped because the group is cancelled. Its `resumeOn` and `resumeOnMainQueue` methods select
+         where the spawning coroutine continues.
+         */
         template<class Func>
-        requires(std::is_invocable_r_v<void, Func, Promise>)
-        static auto invokeDirectly(Func && func) -> DispatchAwaitable {
-            auto * state = new State;
-            DispatchAwaitable ret(state);
+        requires(takesToken<std::decay_t<Func>> || std::is_invocable_v<std::decay_t<Func>>)
+        auto spawn(Func && func) {
+            struct awaiter {
+                Util::RefcntPtr<State> state;
+                std::decay_t<Func> func;
+                SpawnWaiter waiter;
+                
+                auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> awaiter && {
+                    waiter.target.queue = queue;
+                    waiter.target.when = when;
+                    if (queue)
+                        Util::CurrentQueue::tag(queue);
+                    return std::move(*this);
+                }
+                auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> awaiter &&
+                    { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) -> bool {
+                    waiter.target.handle = h;
+                    return state->tryAdmit(waiter) || waiter.target.resume() != h;
+                }
+                void await_resume() {
+                    if (!waiter.admitted)
+                        return;
 #ifdef __cpp_exceptions
-            try {
+                    try {
 #endif
-                std::forward<Func>(func)(Promise(state));
-
+                        runChild(state, std::move(func));
 #ifdef __cpp_exceptions
-            } catch (...) {
-                state->unhandled_exception();
-            }
+                    } catch (...) {
+                        //the child never started so give back its slot
+                        state->release();
+                        throw;
+                    }
 #endif
-            return ret;
+                }
+            };
+            return awaiter{m_state, std::forward<Func>(func), {}};
         }
         
-    private:
-        DispatchAwaitable(State * _Nonnull state) noexcept :
-            m_sharedState(state)
-        {}
+        /**
+         Waits for all children to finish
+         
+         Rethrows the first exception thrown by a child, if any. Like `spawn` the result has `resumeOn` and
+         `resumeOnMainQueue` methods.
+         */
+        auto join() {
+            struct awaiter {
+                Util::RefcntPtr<State> state;
+                Util::ResumeTarget target;
+                
+                auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> awaiter && {
+                    target.queue = queue;
+                    target.when = when;
+                    if (queue)
+                        Util::CurrentQueue::tag(queue);
+                    return std::move(*this);
+                }
+                auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> awaiter &&
+                    { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+                
+                constexpr auto await_ready() const noexcept -> bool
+                    { return false; }
+                auto await_suspend(std::coroutine_handle<> h) -> bool {
+                    target.handle = h;
+                    return state->tryJoin(target) || target.resume() != h;
+                }
+                void await_resume() {
+#ifdef __cpp_exceptions
+                    state->rethrowIfFailed();
+#endif
+                }
+            };
+            return awaiter{m_state, {}};
+        }
+        
+        /**
+         Cancels the group: children waiting to be spawned are dropped and the token given to running ones is cancelled
+         */
+        void cancel() const noexcept
+            { m_state->cancellation().cancel(); }
+        
+        auto token() const noexcept -> CancellationToken
+            { return m_state->cancellation().token(); }
         
+    private:
         template<class Func>
-        requires(std::is_invocable_v<FunctionFromReference<Func>>)
-        static void invokeFromState(void * _Nonnull ptr) noexcept {
-            auto * state = static_cast<StateForFunc<FunctionFromReference<Func>> *>(ptr);
-            Promise promise(state);
+        static auto runChild(Util::RefcntPtr<State> state, Func func) -> DispatchTask<void, SupportsExceptions::No> {
+            co_await resumeOn(state->queue());
 #ifdef __cpp_exceptions
-            if constexpr (!DelayedValue::supportsExceptions) {
+            try {
 #endif
-                invoke(state->func, promise);
+                if constexpr (takesToken<Func>)
+                    co_await func(state->cancellation().token());
+                else
+                    co_await func();
 #ifdef __cpp_exceptions
-            } else {
-                try {
-                    invoke(state->func, promise);
-                } catch (...) {
-                    promise.failure(std::current_exception());
-                }
+            } catch (...) {
+                state->fail(std::current_exception());
             }
 #endif
+            state->release();
         }
         
-        template<class Func>
-        requires(std::is_invocable_v<Func>)
-        static void invoke(Func && func, const Promise & promise) noexcept(!DelayedValue::supportsExceptions) {
-            if constexpr (DelayedValue::isVoid) {
-                std::forward<Func>(func)();
-                promise.success();
-            } else {
-                promise.success(std::forward<Func>(func)());
-            }
-        }
     private:
-        ClientStatePtr m_sharedState;
+        Util::RefcntPtr<State> m_state;
     };
     
-    template<class Func, class... Args>
-    using DispatchAwaitableFor = DispatchAwaitable<decltype(std::declval<Func>()(std::declval<Args>()...)),
-#ifdef __cpp_exceptions
-                                                   std::is_nothrow_invocable_v<Func, Args...> ?
-                                                            SupportsExceptions::No :
-                                                            SupportsExceptions::Yes
-#else
-                                                   SupportsExceptions::No
-#endif
-                                 >;
-    
-    
-    
-    /**
-     @function
-     Converts a call with an asynchronous callback to an awaitable call
-     @param func a callable you supply that will eventually cause the promise passed to it to be fulfilled in some callback
-     */
-    template<class Ret, SupportsExceptions E, class Func>
-    requires(std::is_invocable_r_v<void, Func, typename DispatchAwaitable<Ret, E>::Promise>)
-    auto makeAwaitable(Func && func) {
-        return DispatchAwaitable<Ret, E>::invokeDirectly(std::forward<Func>(func));
-    }
+    //MARK: - Channels
     
     /**
-     @function
-     Converts a call with an asynchronous callback to an awaitable call
+     Bounded multi-producer multi-consumer channel for coroutines
      
-     This overload uses default value for SupportsExceptions setting. If exceptions are enabled in compilation it supports them
-     otherwise no.
-     @param func a callable you supply that will eventually cause the promise passed to it to be fulfilled in some callback
-     */
-    template<class Ret, class Func>
-    requires(std::is_invocable_r_v<void, Func, typename DispatchAwaitable<Ret, CO_DISPATCH_DEFAULT_SE>::Promise>)
-    auto makeAwaitable(Func && func) {
-        return DispatchAwaitable<Ret, CO_DISPATCH_DEFAULT_SE>::invokeDirectly(std::forward<Func>(func));
-    }
-    
-    
-    /**
-     @function
-     Executes a callable on a queue and makes it awaitable from a coroutine
-     */
-    template<class Func>
-    requires(std::is_invocable_v<Func>)
-    auto co_dispatch(dispatch_queue_t _Nonnull queue, Func && func) {
-        return DispatchAwaitableFor<Func>::invokeOnQueue(queue, std::forward<Func>(func));
-    }
-    
-    /**
-     @function
-     Executes a callable on the main queue and makes it awaitable from a coroutine
-     */
-    template<class Func>
-    requires(std::is_invocable_v<Func>)
-    auto co_dispatch(Func && func) {
-        return co_dispatch(dispatch_get_main_queue(), std::forward<Func>(func));
-    }
-    
-    //MARK: - Coroutine task
-    
-    /**
-     Return type for coroutines
+     Values are stored in a lock-free ring buffer and `send`/`receive` that do not need to wait never take a lock.
+     A coroutine that has to wait (sending into a full channel or receiving from an empty one) is parked in an
+     intrusive wait list guarded by a mutex. The operation that unblocks it completes the parked operation on its
+     behalf and then schedules it on the channel's resumption queue or, if there is none, on a global concurrent queue.
+     It is never resumed synchronously by the unblocking operation.
+     
+     Once closed, sends fail and receives drain the remaining values and then produce `std::nullopt`.
+     The channel must outlive all operations on it.
+     
+     @tparam T type of values. Must be nothrow move constructible.
      */
-    template<class Ret = void, SupportsExceptions E = CO_DISPATCH_DEFAULT_SE>
-    class DispatchTask
-    {
+    template<class T>
+    requires(std::is_nothrow_move_constructible_v<T> && std::is_nothrow_destructible_v<T>)
+    class DispatchChannel {
     private:
-        using DelayedValue = Util::ValueCarrier<Ret, E>;
-        
-        struct Promise;
-        using BasicPromise = Util::BasicPromise<Promise, DelayedValue>;
+        struct Waiter {
+            DispatchChannel * _Nonnull channel;
+            Waiter * _Nullable next = nullptr;
+            Util::ResumeTarget target;
+        };
+        struct SendWaiter : Waiter {
+            T * _Nonnull value;
+            bool sent = false;
+        };
+        struct ReceiveWaiter : Waiter {
+            std::optional<T> value;
+        };
         
-        template<bool IsVoid>
-        struct PromiseBase : BasicPromise {
-            template<class Arg>
-            requires(DelayedValue::template IsEmplaceableFrom<Arg>)
-            void return_value(Arg && arg) noexcept(noexcept(this->emplaceReturnValue(std::forward<Arg>(arg))))
-                { this->emplaceReturnValue(std::forward<Arg>(arg)); }
+        template<class W>
+        class WaitList {
+        public:
+            auto front() const noexcept -> W * _Nullable
+                { return m_first; }
+            void push(W * _Nonnull waiter) noexcept {
+                waiter->next = nullptr;
+                if (m_last)
+                    m_last->next = waiter;
+                else
+                    m_first = waiter;
+                m_last = waiter;
+            }
+            auto pop() noexcept -> W * _Nullable {
+                auto * ret = m_first;
+                if (ret) {
+                    m_first = static_cast<W *>(ret->next);
+                    if (!m_first)
+                        m_last = nullptr;
+                }
+                return ret;
+            }
+        private:
+            W * _Nullable m_first = nullptr;
+            W * _Nullable m_last = nullptr;
         };
         
-        template<>
-        struct PromiseBase<true> : BasicPromise {
-            void return_void() noexcept
-                { this->emplaceReturnValue(); }
+        using ReadyList = WaitList<Waiter>;
+        
+        struct Cell {
+            std::atomic<size_t> sequence;
+            alignas(T) std::byte storage[sizeof(T)];
         };
         
+    public:
+        /**
+         @param capacity maximum number of values buffered. Rounded up to a power of 2 and at least 2.
+         @param resumeQueue queue to resume coroutines that had to wait on. If nullptr they are resumed
+         on a global concurrent queue.
+         */
+        DispatchChannel(size_t capacity, dispatch_queue_t _Nullable resumeQueue = nullptr):
+            m_mask(std::bit_ceil(std::max(capacity, size_t(2))) - 1),
+            m_cells(new Cell[m_mask + 1]),
+            m_resumeQueue(resumeQueue) {
+            
+            for (size_t i = 0; i <= m_mask; ++i)
+                m_cells[i].sequence.store(i, std::memory_order_relaxed);
+            if (resumeQueue)
+                Util::CurrentQueue::tag(resumeQueue);
+        }
+        ~DispatchChannel() noexcept {
+            assert(!m_senders.front() && !m_receivers.front());
+            std::optional<T> discard;
+            while (tryPop(discard))
+                discard.reset();
+        }
+        DispatchChannel(DispatchChannel &&) = delete;
+        
+        auto capacity() const noexcept -> size_t
+            { return m_mask + 1; }
+        auto isClosed() const noexcept -> bool
+            { return m_closed.load(std::memory_order_acquire); }
         
-        struct Promise : PromiseBase<std::same_as<Ret, void>> {
-            auto get_return_object() noexcept -> DispatchTask
-                { return {this}; }
-            auto initial_suspend() noexcept -> std::suspend_never
-                { return {}; }
-            auto final_suspend() noexcept  {
-                struct awaiter {
-                    Promise & me;
-                    constexpr bool await_ready() const noexcept { return false; }
-                    auto await_suspend(std::coroutine_handle<> ) const noexcept
-                        { return me.serverComplete(); }
-                    constexpr void await_resume() const noexcept {}
-                };
-                return awaiter{*this};
+        /**
+         Sends a value
+         
+         `co_await`ing the result produces `true` once the value is in the channel or `false` if
+         the channel is closed.
+         */
+        auto send(T value) noexcept {
+            struct awaiter : SendWaiter {
+                T payload;
+                
+                auto await_ready() noexcept -> bool {
+                    auto & channel = *this->channel;
+                    if (channel.isClosed())
+                        return true;
+                    this->sent = channel.tryPush(payload);
+                    if (this->sent)
+                        channel.notifyWaiters();
+                    return this->sent;
+                }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                    this->target = {this->channel->m_resumeQueue, DISPATCH_TIME_NOW, h};
+                    this->value = &payload;
+                    return this->channel->parkSender(this);
+                }
+                auto await_resume() const noexcept -> bool
+                    { return this->sent; }
+            };
+            return awaiter{{{this, nullptr, {}}, nullptr}, std::move(value)};
+        }
+        
+        /**
+         Receives a value
+         
+         `co_await`ing the result produces the value or `std::nullopt` if the channel is closed and empty.
+         */
+        auto receive() noexcept {
+            struct awaiter : ReceiveWaiter {
+                auto await_ready() noexcept -> bool {
+                    auto & channel = *this->channel;
+                    if (channel.tryPop(this->value)) {
+                        channel.notifyWaiters();
+                        return true;
+                    }
+                    if (!channel.isClosed())
+                        return false;
+                    //Closed: a value pushed before closing may have landed after the first attempt
+                    if (channel.tryPop(this->value))
+                        channel.notifyWaiters();
+                    return true;
+                }
+                auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                    this->target = {this->channel->m_resumeQueue, DISPATCH_TIME_NOW, h};
+                    return this->channel->parkReceiver(this);
+                }
+                auto await_resume() noexcept -> std::optional<T>
+                    { return std::move(this->value); }
+            };
+            return awaiter{{{this, nullptr, {}}, {}}};
+        }
+        
+        /**
+         Closes the channel
+         
+         Waiting senders fail and waiting receivers get `std::nullopt`. Values already in the channel
+         can still be received.
+         */
+        void close() noexcept {
+            ReadyList ready;
+            {
+                std::lock_guard lock(m_mutex);
+                m_closed.store(true, std::memory_order_release);
+                drainLocked(ready);
+                while (auto * sender = m_senders.pop()) {
+                    ready.push(sender);
+                    m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                }
+                while (auto * receiver = m_receivers.pop()) {
+                    ready.push(receiver);
+                    m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                }
             }
-            
-            void destroy() const noexcept {
-                auto handle = std::coroutine_handle<Promise>::from_promise(const_cast<Promise &>(*this));
-                handle.destroy();
+            resumeAll(ready);
+        }
+        
+    private:
+        //Lock-free ring buffer. See https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+        
+        auto tryPush(T & value) noexcept -> bool {
+            auto pos = m_enqueuePos.load(std::memory_order_relaxed);
+            Cell * cell;
+            for ( ; ; ) {
+                cell = &m_cells[pos & m_mask];
+                auto seq = cell->sequence.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0) {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
             }
-        };
+            new (cell->storage) T(std::move(value));
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
         
-        using AwaiterBase = Util::Awaiter<Promise>;
+        auto tryPop(std::optional<T> & dest) noexcept -> bool {
+            auto pos = m_dequeuePos.load(std::memory_order_relaxed);
+            Cell * cell;
+            for ( ; ; ) {
+                cell = &m_cells[pos & m_mask];
+                auto seq = cell->sequence.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0) {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            auto * value = std::launder(reinterpret_cast<T *>(cell->storage));
+            dest.emplace(std::move(*value));
+            value->~T();
+            cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
         
-    public:
-        using promise_type = Promise;
+        //Waiting
+        //Parking announces itself in m_waiting and then retries under the lock. Fast paths make their change
+        //and then check m_waiting. The fences guarantee that at least one side sees the other.
         
-    public:
-        DispatchTask(const DispatchTask &) = delete;
-        DispatchTask(DispatchTask &&) noexcept = default;
+        void notifyWaiters() noexcept {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_waiting.load(std::memory_order_relaxed) == 0)
+                return;
+            ReadyList ready;
+            {
+                std::lock_guard lock(m_mutex);
+                drainLocked(ready);
+            }
+            resumeAll(ready);
+        }
         
-        //You must use a temporary to co_await or do co_await std::move(...) on a stored task
-        void operator co_await() & = delete;
-        void operator co_await() const & = delete;
-        auto operator co_await() && noexcept  {
-            struct awaiter : AwaiterBase {
-                decltype(auto) await_resume() const noexcept(noexcept(AwaiterBase::promise->moveOutValue()))
-                    { return AwaiterBase::promise->moveOutValue(); }
-            };
-            return awaiter{std::move(m_promise)};
+        auto parkSender(SendWaiter * _Nonnull waiter) noexcept -> bool {
+            ReadyList ready;
+            {
+                std::lock_guard lock(m_mutex);
+                if (m_closed.load(std::memory_order_relaxed))
+                    return false;
+                m_waiting.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!tryPush(*waiter->value)) {
+                    m_senders.push(waiter);
+                    return true;
+                }
+                m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                waiter->sent = true;
+                drainLocked(ready);
+            }
+            resumeAll(ready);
+            return false;
         }
         
+        auto parkReceiver(ReceiveWaiter * _Nonnull waiter) noexcept -> bool {
+            ReadyList ready;
+            {
+                std::lock_guard lock(m_mutex);
+                m_waiting.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!tryPop(waiter->value)) {
+                    if (m_closed.load(std::memory_order_relaxed)) {
+                        m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    m_receivers.push(waiter);
+                    return true;
+                }
+                m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                drainLocked(ready);
+            }
+            resumeAll(ready);
+            return false;
+        }
         
-        auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchTask && {
-            m_promise->setResumeQueue(queue, when);
-            return std::move(*this);
+        /**
+         Completes as many parked operations as possible
+         */
+        void drainLocked(ReadyList & ready) noexcept {
+            for (bool progress = true; progress; ) {
+                progress = false;
+                while (auto * receiver = m_receivers.front()) {
+                    if (!tryPop(receiver->value))
+                        break;
+                    ready.push(m_receivers.pop());
+                    m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                    progress = true;
+                }
+                while (auto * sender = m_senders.front()) {
+                    if (!tryPush(*sender->value))
+                        break;
+                    sender->sent = true;
+                    ready.push(m_senders.pop());
+                    m_waiting.fetch_sub(1, std::memory_order_relaxed);
+                    progress = true;
+                }
+            }
         }
-        auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> DispatchTask &&
-            { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
         
-    private:
-        DispatchTask(Promise * _Nonnull promise) noexcept :
-            m_promise(promise)
-        {}
+        /**
+         Schedules completed waiters for resumption
+         
+         We are called from inside another coroutine's await_ready/await_suspend so resuming inline would
+         nest the resumed coroutine in its stack, even on the resumption queue.
+         */
+        void resumeAll(ReadyList & ready) noexcept {
+            while (auto * waiter = ready.pop())
+                waiter->target.resumeAsync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+        }
         
     private:
-        Util::ClientAbandonPtr<Promise> m_promise;
+        const size_t m_mask;
+        const std::unique_ptr<Cell[]> m_cells;
+        const Util::QueueHolder m_resumeQueue;
+        alignas(Util::cacheLineSize) std::atomic<size_t> m_enqueuePos = 0;
+        alignas(Util::cacheLineSize) std::atomic<size_t> m_dequeuePos = 0;
+        alignas(Util::cacheLineSize) std::atomic<size_t> m_waiting = 0;
+        std::atomic<bool> m_closed = false;
+        std::mutex m_mutex;
+        WaitList<SendWaiter> m_senders;
+        WaitList<ReceiveWaiter> m_receivers;
     };
     
-    //MARK: - Generator
+    //MARK: - Synchronization
     
-    /**
-     Return type for generators
-     */
-    template<class Ret, SupportsExceptions E = CO_DISPATCH_DEFAULT_SE>
-    requires(!std::is_void_v<Ret>)
-    class DispatchGenerator
-    {
-    private:
-        using DelayedValue = Util::ValueCarrier<Ret, E>;
+    namespace Util {
         
-        struct Promise;
-        using BasicPromise = Util::BasicPromise<Promise, DelayedValue>;
+        struct AsyncLockWaiter {
+            AsyncLockWaiter * _Nullable next = nullptr;
+            uintptr_t units;
+            ResumeTarget target;
+        };
+        
+        class AsyncLockWaiterList {
+        public:
+            auto front() const noexcept -> AsyncLockWaiter * _Nullable
+                { return m_first; }
+            void push(AsyncLockWaiter * _Nonnull waiter) noexcept {
+                waiter->next = nullptr;
+                if (m_last)
+                    m_last->next = waiter;
+                else
+                    m_first = waiter;
+                m_last = waiter;
+            }
+            auto pop() noexcept -> AsyncLockWaiter * _Nullable {
+                auto * ret = m_first;
+                if (ret) {
+                    m_first = ret->next;
+                    if (!m_first)
+                        m_last = nullptr;
+                }
+                return ret;
+            }
+            auto remove(AsyncLockWaiter * _Nonnull waiter) noexcept -> bool {
+                AsyncLockWaiter * prev = nullptr;
+                for (auto * current = m_first; current; prev = current, current = current->next) {
+                    if (current != waiter)
+                        continue;
+                    (prev ? prev->next : m_first) = current->next;
+                    if (m_last == current)
+                        m_last = prev;
+                    return true;
+                }
+                return false;
+            }
+            /**
+             Schedules all waiters for resumption
+             
+             We are called from a releasing coroutine or from inside another coroutine's await_suspend so resuming
+             inline would nest every next waiter in the stack of the previous one.
+             */
+            void resumeAll() noexcept {
+                //waiters may be gone once resumed so unlink first
+                while (auto * waiter = pop())
+                    waiter->target.resumeAsync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+            }
+        private:
+            AsyncLockWaiter * _Nullable m_first = nullptr;
+            AsyncLockWaiter * _Nullable m_last = nullptr;
+        };
         
-        struct Promise : BasicPromise {
+        /**
+         Lock-free core of AsyncMutex, AsyncSemaphore and AsyncSharedMutex
+         
+         The lock state is a single word interpreted by Policy, except for the lowest bit which is set while the
+         oldest waiter cannot be granted the lock. Acquiring or releasing while that bit is clear is a single CAS.
+         
+         Coroutines that have to wait push themselves onto a lock-free stack and request a drain. Drains are
+         serialized by a request counter: whoever raises it from 0 performs them, including any requested
+         meanwhile. The drainer moves waiters from the stack into a FIFO only it touches and grants the lock to
+         them in order while Policy allows. When it cannot, it sets the waiters bit with a CAS against the
+         very state it could not grant from so the release that changes that state is guaranteed to see
+         the bit and request another drain. While the bit is set newcomers queue up rather than barge ahead.
+         */
+        template<class Policy>
+        class AsyncLock {
+        public:
+            static constexpr uintptr_t s_waitersFlag = 1;
             
-            Promise() : BasicPromise(false)
+            explicit AsyncLock(uintptr_t state) noexcept : m_state(state)
             {}
+            ~AsyncLock() noexcept {
+                assert(!m_incoming.load(std::memory_order_relaxed) && !m_waiters.front());
+            }
+            AsyncLock(AsyncLock &&) = delete;
             
-            auto get_return_object() noexcept -> DispatchGenerator
-                { return {this}; }
-            auto initial_suspend() noexcept -> std::suspend_always
-                { return {}; }
-            auto final_suspend() noexcept  {
-                struct awaiter {
-                    Promise & me;
-                    constexpr bool await_ready() const noexcept { return false; }
-                    auto await_suspend(std::coroutine_handle<> ) const noexcept
-                        { return me.serverComplete(); }
-                    constexpr void await_resume() const noexcept {}
-                };
-                return awaiter{*this};
+            auto tryAcquire(uintptr_t units) noexcept -> bool {
+                auto state = m_state.load(std::memory_order_relaxed);
+                while (!(state & s_waitersFlag) && Policy::canAcquire(state, units)) {
+                    if (m_state.compare_exchange_weak(state, Policy::acquire(state, units),
+                                                      std::memory_order_acquire, std::memory_order_relaxed))
+                        return true;
+                }
+                return false;
             }
             
-            template<class Arg>
-            requires(DelayedValue::template IsEmplaceableFrom<Arg>)
-            auto yield_value(Arg && arg) noexcept(noexcept(this->emplaceReturnValue(std::forward<Arg>(arg))))  {
-                this->emplaceReturnValue(std::forward<Arg>(arg));
-                struct awaiter {
-                    Promise & me;
-                    constexpr bool await_ready() const noexcept { return false; }
-                    auto await_suspend(std::coroutine_handle<> ) const noexcept
-                        { return me.serverComplete(); }
-                    constexpr void await_resume() const noexcept {}
-                };
-                return awaiter{*this};
+            void release(uintptr_t units) noexcept {
+                auto state = m_state.load(std::memory_order_relaxed);
+                while (!m_state.compare_exchange_weak(state, Policy::release(state, units),
+                                                      std::memory_order_release, std::memory_order_relaxed))
+                    ;
+                if (state & s_waitersFlag) {
+                    AsyncLockWaiterList ready;
+                    drain(ready);
+                    ready.resumeAll();
+                }
             }
             
-            void return_void() noexcept 
+            /**
+             Slow path of acquisition
+             
+             @returns whether the waiter has to remain suspended. If not it has been granted the lock.
+             If it does it might have already been resumed by the time this returns.
+             */
+            auto wait(AsyncLockWaiter * _Nonnull waiter) noexcept -> bool {
+                auto head = m_incoming.load(std::memory_order_relaxed);
+                do {
+                    waiter->next = head;
+                } while (!m_incoming.compare_exchange_weak(head, waiter, std::memory_order_release, std::memory_order_relaxed));
+                
+                AsyncLockWaiterList ready;
+                drain(ready);
+                //only compares the pointer so it is fine if waiter has been resumed elsewhere
+                bool granted = ready.remove(waiter);
+                ready.resumeAll();
+                return !granted;
+            }
+            
+        private:
+            void drain(AsyncLockWaiterList & ready) noexcept {
+                if (m_drainRequests.fetch_add(1, std::memory_order_acq_rel) != 0)
+                    return;
+                for (size_t handled = 1; ; ) {
+                    //the stack has the newest waiter on top
+                    auto * incoming = m_incoming.exchange(nullptr, std::memory_order_acquire);
+                    AsyncLockWaiter * oldestFirst = nullptr;
+                    while (incoming) {
+                        auto * next = incoming->next;
+                        incoming->next = oldestFirst;
+                        oldestFirst = incoming;
+                        incoming = next;
+                    }
+                    while (oldestFirst) {
+                        auto * next = oldestFirst->next;
+                        m_waiters.push(oldestFirst);
+                        oldestFirst = next;
+                    }
+                    
+                    grant(ready);
+                    
+                    auto requests = m_drainRequests.fetch_sub(handled, std::memory_order_acq_rel);
+                    if (requests == handled)
+                        return;
+                    handled = requests - handled;
+                }
+            }
+            
+            void grant(AsyncLockWaiterList & ready) noexcept {
+                auto state = m_state.load(std::memory_order_relaxed);
+                for ( ; ; ) {
+                    auto * waiter = m_waiters.front();
+                    bool granting = waiter && Policy::canAcquire(state, waiter->units);
+                    uintptr_t newState;
+                    if (granting)
+                        newState = Policy::acquire(state, waiter->units);
+                    else if (waiter)
+                        newState = state | s_waitersFlag;
+                    else
+                        newState = state & ~s_waitersFlag;
+                    if (!granting && newState == state)
+                        return;
+                    if (!m_state.compare_exchange_weak(state, newState, std::memory_order_acq_rel, std::memory_order_relaxed))
+                        continue;
+                    if (!granting)
+                        return;
+                    ready.push(m_waiters.pop());
+                    state = newState;
+                }
+            }
+            
+        private:
+            std::atomic<uintptr_t> m_state;
+            std::atomic<AsyncLockWaiter *> m_incoming = nullptr;
+            std::atomic<size_t> m_drainRequests = 0;
+            AsyncLockWaiterList m_waiters;
+        };
+        
+        /**
+         Owns an acquired AsyncLock and releases it on destruction
+         */
+        template<class Policy>
+        class AsyncLockGuard {
+        public:
+            AsyncLockGuard(AsyncLock<Policy> & lock, uintptr_t units) noexcept :
+                m_lock(&lock),
+                m_units(units)
             {}
+            AsyncLockGuard(AsyncLockGuard && src) noexcept :
+                m_lock(std::exchange(src.m_lock, nullptr)),
+                m_units(src.m_units)
+            {}
+            auto operator=(AsyncLockGuard && src) noexcept -> AsyncLockGuard & {
+                if (this != &src) {
+                    unlock();
+                    m_lock = std::exchange(src.m_lock, nullptr);
+                    m_units = src.m_units;
+                }
+                return *this;
+            }
+            ~AsyncLockGuard() noexcept
+                { unlock(); }
             
-            void destroy() const noexcept {
-                auto handle = std::coroutine_handle<Promise>::from_promise(const_cast<Promise &>(*this));
-                handle.destroy();
+            auto ownsLock() const noexcept -> bool
+                { return m_lock != nullptr; }
+            
+            /**
+             Releases the lock early. Does nothing if already released.
+             */
+            void unlock() noexcept {
+                if (auto * lock = std::exchange(m_lock, nullptr))
+                    lock->release(m_units);
             }
+        private:
+            AsyncLock<Policy> * _Nullable m_lock;
+            uintptr_t m_units;
         };
         
-        using AwaiterBase = Util::Awaiter<Promise>;
+        /**
+         Awaitable returned from lock acquisition methods
+         
+         Produces nothing or, if Guard is not void, a guard owning the lock.
+         */
+        template<class Policy, class Guard>
+        class AsyncLockAwaiter {
+        public:
+            AsyncLockAwaiter(AsyncLock<Policy> & lock, uintptr_t units) noexcept : m_lock(lock)
+                { m_waiter.units = units; }
+            
+            /**
+             Resume on a given queue after acquiring the lock
+             
+             Without it a coroutine that had to wait is resumed on a global concurrent queue.
+             */
+            auto resumeOn(dispatch_queue_t _Nullable queue, dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> AsyncLockAwaiter && {
+                m_waiter.target.queue = queue;
+                m_waiter.target.when = when;
+                if (queue)
+                    CurrentQueue::tag(queue);
+                return std::move(*this);
+            }
+            auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) && noexcept -> AsyncLockAwaiter &&
+                { return std::move(*this).resumeOn(dispatch_get_main_queue(), when); }
+            
+            auto await_ready() noexcept -> bool {
+                auto & target = m_waiter.target;
+                m_mustSwitch = target.queue && (target.when != DISPATCH_TIME_NOW || !CurrentQueue::is(target.queue));
+                return !m_mustSwitch && m_lock.tryAcquire(m_waiter.units);
+            }
+            auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+                m_waiter.target.handle = h;
+                bool acquired = m_mustSwitch && m_lock.tryAcquire(m_waiter.units);
+                if (!acquired && m_lock.wait(&m_waiter))
+                    return true;
+                if (!m_mustSwitch)
+                    return false;
+                m_waiter.target.resumeAsync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+                return true;
+            }
+            auto await_resume() const noexcept -> Guard {
+                if constexpr (!std::is_void_v<Guard>)
+                    return Guard(m_lock, m_waiter.units);
+            }
+        private:
+            AsyncLock<Policy> & m_lock;
+            AsyncLockWaiter m_waiter;
+            bool m_mustSwitch = false;
+        };
+        
+        struct AsyncMutexPolicy {
+            static constexpr uintptr_t s_locked = 2;
+            
+            static constexpr auto canAcquire(uintptr_t state, uintptr_t) noexcept -> bool
+                { return !(state & s_locked); }
+            static constexpr auto acquire(uintptr_t state, uintptr_t) noexcept -> uintptr_t
+                { return state | s_locked; }
+            static constexpr auto release(uintptr_t state, uintptr_t) noexcept -> uintptr_t
+                { return state & ~s_locked; }
+        };
         
+        struct AsyncSemaphorePolicy {
+            //count is stored above the waiters flag
+            static constexpr auto canAcquire(uintptr_t state, uintptr_t units) noexcept -> bool
+                { return (state >> 1) >= units; }
+            static constexpr auto acquire(uintptr_t state, uintptr_t units) noexcept -> uintptr_t
+                { return state - (units << 1); }
+            static constexpr auto release(uintptr_t state, uintptr_t units) noexcept -> uintptr_t
+                { return state + (units << 1); }
+        };
+        
+        struct AsyncSharedMutexPolicy {
+            static constexpr uintptr_t s_exclusive = 0;
+            static constexpr uintptr_t s_shared = 1;
+            
+            static constexpr uintptr_t s_writer = 2;
+            static constexpr uintptr_t s_reader = 4;
+            
+            static constexpr auto canAcquire(uintptr_t state, uintptr_t units) noexcept -> bool {
+                if (units == s_shared)
+                    return !(state & s_writer);
+                return (state >> 1) == 0;
+            }
+            static constexpr auto acquire(uintptr_t state, uintptr_t units) noexcept -> uintptr_t
+                { return units == s_shared ? state + s_reader : state | s_writer; }
+            static constexpr auto release(uintptr_t state, uintptr_t units) noexcept -> uintptr_t
+                { return units == s_shared ? state - s_reader : state & ~s_writer; }
+        };
+    }
+    
+    /**
+     Mutex for coroutines
+     
+     Unlike `std::mutex` it can be held across `co_await` and waiting for it suspends the coroutine instead of
+     blocking a thread. Waiters acquire it in FIFO order. Uncontended lock and unlock are a single CAS each.
+     
+     A coroutine that had to wait is resumed synchronously by `unlock()` on the releasing thread unless
+     you call `resumeOn` on the result of `lock()`. With `resumeOn` the coroutine always continues on the given
+     queue, as with DispatchAwaitable.
+     */
+    class AsyncMutex {
+    private:
+        using Policy = Util::AsyncMutexPolicy;
     public:
-        using promise_type = Promise;
+        using Guard = Util::AsyncLockGuard<Policy>;
+        
+        AsyncMutex() noexcept : m_lock(0)
+        {}
+        AsyncMutex(AsyncMutex &&) = delete;
         
+        /**
+         `co_await`ing the result acquires the mutex. You need to call `unlock()` afterwards.
+         */
+        auto lock() noexcept
+            { return Util::AsyncLockAwaiter<Policy, void>(m_lock, 0); }
+        /**
+         `co_await`ing the result acquires the mutex and produces a Guard that unlocks it
+         */
+        auto scopedLock() noexcept
+            { return Util::AsyncLockAwaiter<Policy, Guard>(m_lock, 0); }
+        auto tryLock() noexcept -> bool
+            { return m_lock.tryAcquire(0); }
+        void unlock() noexcept
+            { m_lock.release(0); }
+    private:
+        Util::AsyncLock<Policy> m_lock;
+    };
+    
+    /**
+     Counting semaphore for coroutines
+     
+     Waiting for a permit suspends the coroutine. Waiters are served in FIFO order. Resumption follows the same rules
+     as for AsyncMutex.
+     */
+    class AsyncSemaphore {
+    private:
+        using Policy = Util::AsyncSemaphorePolicy;
     public:
-        DispatchGenerator(const DispatchGenerator &) = delete;
-        DispatchGenerator(DispatchGenerator &&) noexcept = default;
+        using Guard = Util::AsyncLockGuard<Policy>;
         
-        class Iterator {
-            friend DispatchGenerator;
-        private:
-            struct FirstAwaitable {
-                Util::ClientAbandonPtr<Promise> m_promise;
-                Util::QueueHolder m_queue;
-                
-                void operator co_await() & = delete;
-                void operator co_await() const & = delete;
-                auto operator co_await() && noexcept  {
-                    struct awaiter : AwaiterBase {
-                        Util::QueueHolder queue;
-                        auto await_resume() noexcept(noexcept(AwaiterBase::promise->getValueToken())) -> Iterator {
-                            return Iterator(std::move(AwaiterBase::promise), queue, AwaiterBase::promise->getValueToken());
-                        }
-                    };
-                    return awaiter{{std::move(m_promise)}, Util::QueueHolder{m_queue}};
-                };
-            };
-            struct NextAwaitable {
-                Util::ClientAbandonPtr<Promise> promise;
-                Iterator * _Nonnull it;
-                
-                void operator co_await() & = delete;
-                void operator co_await() const & = delete;
-                auto operator co_await() && noexcept  {
-                    struct awaiter : AwaiterBase {
-                        Iterator * _Nonnull it;
-                        void await_resume() noexcept(noexcept(it->m_promise->getValueToken())) {
-                            it->m_promise = std::move(AwaiterBase::promise);
-                            it->m_valueToken = it->m_promise->getValueToken();
-                        }
-                    };
-                    return awaiter{{std::move(promise)}, it};
-                }
-            };
+        explicit AsyncSemaphore(size_t initialCount) noexcept : m_lock(uintptr_t(initialCount) << 1)
+            { assert(initialCount <= (std::numeric_limits<uintptr_t>::max() >> 1)); }
+        AsyncSemaphore(AsyncSemaphore &&) = delete;
+        
+        /**
+         `co_await`ing the result acquires a permit. You need to call `release()` afterwards.
+         */
+        auto acquire() noexcept
+            { return Util::AsyncLockAwaiter<Policy, void>(m_lock, 1); }
+        /**
+         `co_await`ing the result acquires a permit and produces a Guard that releases it
+         */
+        auto scopedAcquire() noexcept
+            { return Util::AsyncLockAwaiter<Policy, Guard>(m_lock, 1); }
+        auto tryAcquire() noexcept -> bool
+            { return m_lock.tryAcquire(1); }
+        void release(size_t count = 1) noexcept
+            { m_lock.release(count); }
+    private:
+        Util::AsyncLock<Policy> m_lock;
+    };
+    
+    /**
+     Readers-writer lock for coroutines
+     
+     Any number of coroutines can hold it shared or one can hold it exclusively. Waiters are served in FIFO order
+     so a waiting writer is not starved by a stream of readers: readers that arrive after it wait too.
+     Resumption follows the same rules as for AsyncMutex.
+     */
+    class AsyncSharedMutex {
+    private:
+        using Policy = Util::AsyncSharedMutexPolicy;
+    public:
+        using Guard = Util::AsyncLockGuard<Policy>;
+        
+        AsyncSharedMutex() noexcept : m_lock(0)
+        {}
+        AsyncSharedMutex(AsyncSharedMutex &&) = delete;
+        
+        auto lock() noexcept
+            { return Util::AsyncLockAwaiter<Policy, void>(m_lock, Policy::s_exclusive); }
+        auto scopedLock() noexcept
+            { return Util::AsyncLockAwaiter<Policy, Guard>(m_lock, Policy::s_exclusive); }
+        auto tryLock() noexcept -> bool
+            { return m_lock.tryAcquire(Policy::s_exclusive); }
+        void unlock() noexcept
+            { m_lock.release(Policy::s_exclusive); }
+        
+        auto lockShared() noexcept
+            { return Util::AsyncLockAwaiter<Policy, void>(m_lock, Policy::s_shared); }
+        auto scopedLockShared() noexcept
+            { return Util::AsyncLockAwaiter<Policy, Guard>(m_lock, Policy::s_shared); }
+        auto tryLockShared() noexcept -> bool
+            { return m_lock.tryAcquire(Policy::s_shared); }
+        void unlockShared() noexcept
+            { m_lock.release(Policy::s_shared); }
+    private:
+        Util::AsyncLock<Policy> m_lock;
+    };
+    
+    //MARK: - Pipelines
+    
+    namespace Util {
+        class PipelineMeter;
+        
+        template<class R>
+        concept MemberAwaitable = requires(R && r) {
+            std::forward<R>(r).operator co_await().await_resume();
+        };
+        
+        template<class R>
+        struct AwaitedResult {
+            using Type = R;
+        };
+        template<MemberAwaitable R>
+        struct AwaitedResult<R> {
+            using Type = decltype(std::declval<R>().operator co_await().await_resume());
+        };
+    }
+    
+    /**
+     Counters collected by a pipeline stage or sink
+     
+     They are updated as the stage runs and can be read at any time. Comparing them between stages shows where
+     the bottleneck is: the slowest stage is busy most of the time while stages before it wait for output
+     and stages after it wait for input.
+     */
+    class PipelineStats {
+        friend Util::PipelineMeter;
+    public:
+        PipelineStats() noexcept = default;
+        PipelineStats(PipelineStats &&) = delete;
+        
+        /// Number of values processed
+        auto items() const noexcept -> uint64_t
+            { return m_items.load(std::memory_order_relaxed); }
+        /// Time spent in the stage function
+        auto busy() const noexcept -> std::chrono::nanoseconds
+            { return std::chrono::nanoseconds(m_busy.load(std::memory_order_relaxed)); }
+        /// Time spent waiting for the previous stage to produce a value
+        auto waitingForInput() const noexcept -> std::chrono::nanoseconds
+            { return std::chrono::nanoseconds(m_waitingForInput.load(std::memory_order_relaxed)); }
+        /// Time spent waiting for the next stage to accept a value. Always 0 for sinks.
+        auto waitingForOutput() const noexcept -> std::chrono::nanoseconds
+            { return std::chrono::nanoseconds(m_waitingForOutput.load(std::memory_order_relaxed)); }
+    private:
+        std::atomic<uint64_t> m_items = 0;
+        std::atomic<std::chrono::nanoseconds::rep> m_busy = 0;
+        std::atomic<std::chrono::nanoseconds::rep> m_waitingForInput = 0;
+        std::atomic<std::chrono::nanoseconds::rep> m_waitingForOutput = 0;
+    };
+    
+    namespace Util {
+        
+        /**
+         Charges the time since the previous event to PipelineStats counters. Does nothing without stats.
+         */
+        class PipelineMeter {
+        private:
+            using Counter = std::atomic<std::chrono::nanoseconds::rep> PipelineStats::*;
         public:
-            Iterator(Iterator && src) noexcept = default;
-            
-            decltype(auto) operator*() const noexcept(noexcept(Promise::moveOutValue(m_valueToken)))
-                { return Promise::moveOutValue(m_valueToken); }
-            auto next() noexcept {
-                m_valueToken = nullptr;
-                m_promise->resumeExecution(m_queue);
-                return NextAwaitable{{std::move(m_promise)}, this};
+            PipelineMeter(PipelineStats * _Nullable stats) noexcept : m_stats(stats) {
+                if (m_stats)
+                    m_last = std::chrono::steady_clock::now();
             }
-            operator bool() const noexcept {
-                return m_valueToken;
+            
+            void receivedInput() noexcept
+                { charge(&PipelineStats::m_waitingForInput); }
+            void processed() noexcept {
+                if (m_stats)
+                    m_stats->m_items.fetch_add(1, std::memory_order_relaxed);
+                charge(&PipelineStats::m_busy);
             }
+            void deliveredOutput() noexcept
+                { charge(&PipelineStats::m_waitingForOutput); }
         private:
-            Iterator(Util::ClientAbandonPtr<Promise> && promise, dispatch_queue_t _Nullable queue, DelayedValue::ValueToken valueToken):
-                m_promise(std::move(promise)),
-                m_queue(queue),
-                m_valueToken(valueToken)
-            {}
+            void charge(Counter counter) noexcept {
+                if (!m_stats)
+                    return;
+                auto now = std::chrono::steady_clock::now();
+                auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last);
+                (m_stats->*counter).fetch_add(elapsed.count(), std::memory_order_relaxed);
+                m_last = now;
+            }
         private:
-            Util::ClientAbandonPtr<Promise> m_promise;
-            Util::QueueHolder m_queue;
-            DelayedValue::ValueToken m_valueToken;
+            PipelineStats * _Nullable m_stats;
+            std::chrono::steady_clock::time_point m_last;
         };
+    }
+    
+    /**
+     Pipeline stage created by `pipelineStage()`
+     */
+    template<class Func>
+    class PipelineStage {
+    public:
+        PipelineStage(dispatch_queue_t _Nonnull queue, Func func, size_t capacity) :
+            m_queue(queue),
+            m_func(std::move(func)),
+            m_capacity(capacity)
+        {}
         
-        auto beginOn(dispatch_queue_t _Nullable queue) && noexcept {
-            m_promise->resumeExecution(queue);
-            return typename Iterator::FirstAwaitable{{std::move(m_promise)}, Util::QueueHolder{queue}};
+        /**
+         Collect counters for this stage into stats which must outlive the pipeline
+         */
+        auto withStats(PipelineStats & stats) && noexcept -> PipelineStage && {
+            m_stats = &stats;
+            return std::move(*this);
         }
         
-        auto begin() && noexcept
-            { return std::move(*this).beginOn(dispatch_get_main_queue()); }
-        
-        auto beginSync() && noexcept
-            { return std::move(*this).beginOn(nullptr); }
-        
-        auto resumingOn(dispatch_queue_t _Nullable queue) && noexcept -> DispatchGenerator && {
-            m_promise->setResumeQueue(queue, DISPATCH_TIME_NOW);
-            return std::move(*this);
+        template<class T, SupportsExceptions E>
+        friend auto operator|(DispatchGenerator<T, E> && source, PipelineStage && stage) {
+            using Result = std::remove_cvref_t<typename Util::AwaitedResult<std::invoke_result_t<Func &, T>>::Type>;
+            static_assert(!std::is_void_v<Result>, "pipeline stage must produce a value, use pipelineSink() for the last step");
+            auto queue = stage.m_queue;
+            auto capacity = stage.m_capacity;
+            return run<Result>(std::move(source), std::move(stage)).prefetch(capacity, queue);
         }
-        auto resumingOnMainQueue() && noexcept -> DispatchGenerator &&
-            { return std::move(*this).resumingOn(dispatch_get_main_queue()); }
-    
     private:
-        DispatchGenerator(Promise * _Nonnull promise) noexcept :
-            m_promise(promise)
+        template<class Result, class T, SupportsExceptions E>
+        static auto run(DispatchGenerator<T, E> source, PipelineStage stage) -> DispatchGenerator<Result, E> {
+            Util::PipelineMeter meter(stage.m_stats);
+            for (auto it = co_await std::move(source).resumingOn(stage.m_queue).beginSync(); it; ) {
+                meter.receivedInput();
+                if constexpr (Util::MemberAwaitable<std::invoke_result_t<Func &, T>>) {
+                    Result result = co_await std::invoke(stage.m_func, *it);
+                    meter.processed();
+                    co_yield std::move(result);
+                } else {
+                    Result result = std::invoke(stage.m_func, *it);
+                    meter.processed();
+                    co_yield std::move(result);
+                }
+                meter.deliveredOutput();
+                co_await it.next();
+            }
+        }
+    private:
+        Util::QueueHolder m_queue;
+        Func m_func;
+        size_t m_capacity;
+        PipelineStats * _Nullable m_stats = nullptr;
+    };
+    
+    /**
+     Pipeline sink created by `pipelineSink()`
+     */
+    template<class Func>
+    class PipelineSink {
+    public:
+        PipelineSink(dispatch_queue_t _Nonnull queue, Func func) :
+            m_queue(queue),
+            m_func(std::move(func))
         {}
         
+        /**
+         Collect counters for this sink into stats which must outlive the pipeline
+         */
+        auto withStats(PipelineStats & stats) && noexcept -> PipelineSink && {
+            m_stats = &stats;
+            return std::move(*this);
+        }
+        
+        template<class T, SupportsExceptions E>
+        friend auto operator|(DispatchGenerator<T, E> && source, PipelineSink && sink) -> DispatchTask<void, E>
+            { return run(std::move(source), std::move(sink)); }
     private:
-        Util::ClientAbandonPtr<Promise> m_promise;
+        template<class T, SupportsExceptions E>
+        static auto run(DispatchGenerator<T, E> source, PipelineSink sink) -> DispatchTask<void, E> {
+            Util::PipelineMeter meter(sink.m_stats);
+            for (auto it = co_await std::move(source).resumingOn(sink.m_queue).beginSync(); it; ) {
+                meter.receivedInput();
+                if constexpr (Util::MemberAwaitable<std::invoke_result_t<Func &, T>>)
+                    co_await std::invoke(sink.m_func, *it);
+                else
+                    std::invoke(sink.m_func, *it);
+                meter.processed();
+                co_await it.next();
+            }
+        }
+    private:
+        Util::QueueHolder m_queue;
+        Func m_func;
+        PipelineStats * _Nullable m_stats = nullptr;
     };
     
-    //MARK: - Switching queues
+    /**
+     Creates a pipeline stage
+     
+     `generator | pipelineStage(queue, func)` produces a generator of `func(value)` for each value of `generator`. 
+     The stage runs on its queue concurrently with stages before and after it, buffering up to `capacity` 
+     results (see DispatchGenerator::prefetch) for the next one. `func` can return a plain value or an 
+     awaitable such as DispatchTask whose result is used.
+     */
+    template<class Func>
+    auto pipelineStage(dispatch_queue_t _Nonnull queue, Func && func, size_t capacity = 16) {
+        return PipelineStage<std::decay_t<Func>>(queue, std::forward<Func>(func), capacity);
+    }
     
     /**
-     @function
-     `co_await`ing this will resume the coroutine on a given queue optionally on or after a given time
+     Creates a pipeline sink
      
-     If you pass your current queue and non default `when` this is equivalent to an asynchronous sleep
-     until `when` - now.
+     `generator | pipelineSink(queue, func)` produces a DispatchTask that calls `func(value)` on the queue for each value
+     of `generator`. `func` can return void or an awaitable to await.
      */
-    inline auto resumeOn(dispatch_queue_t _Nonnull queue, dispatch_time_t when = DISPATCH_TIME_NOW) noexcept {
-        struct Awaitable
-        {
-            dispatch_queue_t queue;
-            dispatch_time_t when;
-            auto await_ready() noexcept
-                { return false; }
-            auto await_suspend(std::coroutine_handle<> h) noexcept {
-                if (when == DISPATCH_TIME_NOW)
-                    dispatch_async_f(queue, h.address(), Awaitable::resume);
-                else
-                    dispatch_after_f(when, queue, h.address(), Awaitable::resume);
-                return std::noop_coroutine();
-            }
-            void await_resume() noexcept
-                {}
-            
-            static void resume(void * addr) noexcept {
-                auto h = std::coroutine_handle<>::from_address(addr);
-                h.resume();
-            }
-        };
-        return Awaitable{queue, when};
+    template<class Func>
+    auto pipelineSink(dispatch_queue_t _Nonnull queue, Func && func) {
+        return PipelineSink<std::decay_t<Func>>(queue, std::forward<Func>(func));
     }
     
+    //MARK: - Parallel algorithms
+    
+#if __cpp_lib_ranges
     /**
      @function
-     `co_await`ing this will resume a coroutine on the main queue optionally on or after a given time
+     Parallel `std::transform_reduce` over a random access range
      
-     If you are already on the main queue and pass non default  `when` this is equivalent to an asynchronous sleep
-     until `when` - now.
+     Elements are processed on the queue in chunks of `grain` consecutive elements by up to one worker per CPU.
+     Each worker reduces the chunks it picks up into its own partial result which are combined with `init`
+     at the end. Like with `std::transform_reduce` the order of reduction is unspecified so `reduceOp` must be
+     associative and commutative.
+     
+     The range must remain valid until the returned task completes. If `grain` is 0 it is chosen automatically.
      */
-    inline auto resumeOnMainQueue(dispatch_time_t when = DISPATCH_TIME_NOW) noexcept {
-        return resumeOn(dispatch_get_main_queue(), when);
+    template<std::ranges::random_access_range Range, class T, class ReduceOp, class TransformOp>
+    requires(std::ranges::sized_range<Range> && std::ranges::borrowed_range<Range> &&
+             std::is_invocable_v<const TransformOp &, std::ranges::range_reference_t<Range>> &&
+             std::constructible_from<T, std::invoke_result_t<const TransformOp &, std::ranges::range_reference_t<Range>>> &&
+             std::is_invocable_r_v<T, const ReduceOp &, T, T>)
+    auto parallelTransformReduce(dispatch_queue_t _Nonnull queue, Range && range, T init, ReduceOp reduceOp, TransformOp transformOp,
+                                 size_t grain = 0) -> DispatchTask<T> {
+        
+        struct alignas(Util::cacheLineSize) Partial {
+            std::optional<T> value;
+        };
+        
+        auto first = std::ranges::begin(range);
+        size_t size = std::ranges::size(range);
+        if (grain == 0)
+            grain = std::max(size / (Util::applyConcurrency() * 8), size_t(1));
+        size_t chunkCount = size / grain + (size % grain != 0);
+        size_t workers = std::min(chunkCount, Util::applyConcurrency());
+        
+        std::vector<Partial> partials(workers);
+        std::atomic<size_t> nextChunk = 0;
+        co_await co_dispatch_apply(queue, workers, [&](size_t worker) {
+            std::optional<T> acc;
+#ifdef __cpp_exceptions
+            try {
+#endif
+                for ( ; ; ) {
+                    auto chunk = nextChunk.fetch_add(1, std::memory_order_relaxed);
+                    if (chunk >= chunkCount)
+                        break;
+                    auto last = std::min((chunk + 1) * grain, size);
+                    for (auto i = chunk * grain; i < last; ++i) {
+                        decltype(auto) transformed = transformOp(first[std::ranges::range_difference_t<Range>(i)]);
+                        if (acc)
+                            acc.emplace(reduceOp(std::move(*acc), std::forward<decltype(transformed)>(transformed)));
+                        else
+                            acc.emplace(std::forward<decltype(transformed)>(transformed));
+                    }
+                }
+#ifdef __cpp_exceptions
+            } catch (...) {
+                //apply only stops workers that have not started yet so make the running ones run out of chunks
+                nextChunk.store(chunkCount, std::memory_order_relaxed);
+                throw;
+            }
+#endif
+            partials[worker].value = std::move(acc);
+        });
+        
+        for (auto & partial: partials) {
+            if (partial.value)
+                init = reduceOp(std::move(init), std::move(*partial.value));
+        }
+        co_return init;
     }
+#endif
     
     //MARK: - Dispatch IO wrappers
     
+    /**
+     Zero-copy view of the bytes of a `dispatch_data_t`
+     
+     Dispatch data can consist of multiple discontiguous regions. Unlike `dispatch_data_create_map` this
+     never flattens or copies them. `regions()` gives the regions as spans while iterating the view itself goes over
+     individual bytes transparently crossing region boundaries.
+     
+     The view retains the data object and each of its regions so it remains valid independently of them.
+     Iterators are invalidated when the view is destroyed or assigned to.
+     */
+    class DispatchDataView {
+    public:
+        using Region = std::span<const std::byte>;
+        
+        /**
+         Bidirectional iterator over the bytes of all regions
+         */
+        class iterator {
+            friend DispatchDataView;
+        public:
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = std::byte;
+            using difference_type = ptrdiff_t;
+            using pointer = const std::byte *;
+            using reference = const std::byte &;
+            
+            iterator() noexcept = default;
+            
+            auto operator*() const noexcept -> reference
+                { return (*m_region)[m_index]; }
+            
+            auto operator++() noexcept -> iterator & {
+                if (++m_index == m_region->size()) {
+                    ++m_region;
+                    m_index = 0;
+                }
+                return *this;
+            }
+            auto operator++(int) noexcept -> iterator {
+                auto ret = *this;
+                ++*this;
+                return ret;
+            }
+            auto operator--() noexcept -> iterator & {
+                if (m_index == 0) {
+                    --m_region;
+                    m_index = m_region->size();
+                }
+                --m_index;
+                return *this;
+            }
+            auto operator--(int) noexcept -> iterator {
+                auto ret = *this;
+                --*this;
+                return ret;
+            }
+            
+            friend auto operator==(const iterator & lhs, const iterator & rhs) noexcept -> bool
+                { return lhs.m_region == rhs.m_region && lhs.m_index == rhs.m_index; }
+            
+            /**
+             The rest of the region the iterator points into, starting from the current byte
+             
+             Lets parsers process whole runs of contiguous bytes at a time. Must not be called on end iterator.
+             */
+            auto contiguous() const noexcept -> Region
+                { return m_region->subspan(m_index); }
+            
+        private:
+            iterator(const Region * _Nullable region, size_t index) noexcept :
+                m_region(region),
+                m_index(index)
+            {}
+        private:
+            const Region * _Nullable m_region = nullptr;
+            size_t m_index = 0;
+        };
+        using const_iterator = iterator;
+        
+        DispatchDataView() noexcept = default;
+        
+        explicit DispatchDataView(dispatch_data_t _Nullable data):
+            m_data(data) {
+            
+            if (!data)
+                return;
+            auto * regions = &m_regions;
+            auto * regionData = &m_regionData;
+            auto * size = &m_size;
+            dispatch_data_apply(data, ^ (dispatch_data_t region, size_t, const void * buffer, size_t bufferSize) {
+                //empty regions would break iterator invariants
+                if (bufferSize) {
+                    //the buffer is only guaranteed to be valid while the region object is alive
+                    regionData->emplace_back(region);
+                    regions->emplace_back(static_cast<const std::byte *>(buffer), bufferSize);
+                    *size += bufferSize;
+                }
+                return true;
+            });
+        }
+        
+        auto data() const noexcept -> dispatch_data_t _Nullable
+            { return m_data; }
+        
+        auto regions() const & noexcept -> std::span<const Region>
+            { return m_regions; }
+        //The regions would dangle. This catches for (auto region: result.bytes().regions())
+        void regions() const && = delete;
+        
+        auto size() const noexcept -> size_t
+            { return m_size; }
+        auto empty() const noexcept -> bool
+            { return m_size == 0; }
+        
+        auto begin() const noexcept -> iterator
+            { return iterator(m_regions.data(), 0); }
+        auto end() const noexcept -> iterator
+            { return iterator(m_regions.data() + m_regions.size(), 0); }
+        
+    private:
+        Util::DataHolder m_data;
+        std::vector<Region> m_regions;
+        //parallel to m_regions so that regions() can stay a plain span
+        std::vector<Util::DataHolder> m_regionData;
+        size_t m_size = 0;
+    };
+    
     /**
      Result returned from all Dispatch IO operations
      */
@@ -1130,6 +5333,11 @@ inline namespace CO_DISPATCH_NS {
          */
         auto data() const noexcept -> dispatch_data_t _Nullable
             { return m_data; }
+        /**
+         Zero-copy view of the bytes of data()
+         */
+        auto bytes() const -> DispatchDataView
+            { return DispatchDataView(m_data); }
         /**
          This value is 0 if the data was read/written successfully. If an error occurred, it contains the error number.
          */
@@ -1140,6 +5348,68 @@ inline namespace CO_DISPATCH_NS {
         int m_error = 0;
     };
     
+    /**
+     Result of Dispatch IO operations into caller provided buffers
+     */
+    struct DispatchIOTransferResult {
+        DispatchIOTransferResult() noexcept = default;
+        
+        DispatchIOTransferResult(size_t transferred, int error) noexcept:
+            m_transferred(transferred),
+            m_error(error)
+        {}
+        
+        /**
+         Number of bytes transferred
+         */
+        auto transferred() const noexcept -> size_t
+            { return m_transferred; }
+        /**
+         This value is 0 if the operation was successful. If an error occurred, it contains the error number.
+         */
+        auto error() const noexcept -> int
+            { return m_error; }
+    private:
+        size_t m_transferred = 0;
+        int m_error = 0;
+    };
+    
+    namespace Util {
+        
+        template<class Container>
+        using ContainerElement = std::remove_pointer_t<decltype(std::data(std::declval<Container &>()))>;
+        
+        /**
+         A contiguous container of plain bytes or other trivially copyable values passed by rvalue
+         */
+        template<class Container>
+        concept DispatchDataStorage = !std::is_lvalue_reference_v<Container> &&
+                                      std::is_move_constructible_v<std::remove_cvref_t<Container>> &&
+        requires(std::remove_cvref_t<Container> & container) {
+            { std::size(container) } -> std::convertible_to<size_t>;
+            { std::data(container) } -> std::convertible_to<const void *>;
+        } &&
+        std::is_trivially_copyable_v<ContainerElement<std::remove_cvref_t<Container>>>;
+    }
+    
+    /**
+     @function
+     Creates dispatch data that takes ownership of a container without copying its contents
+     
+     The container, such as `std::vector` or `std::string`, is moved to the heap and destroyed when the returned
+     data object is. Its contents are never copied. Like `dispatch_data_create` the result is returned retained.
+     */
+    template<class Container>
+    requires(Util::DispatchDataStorage<Container>)
+    auto makeDispatchData(Container && container) -> dispatch_data_t _Nonnull {
+        using Stored = std::remove_cvref_t<Container>;
+        auto * stored = new Stored(std::move(container));
+        auto size = std::size(*stored) * sizeof(Util::ContainerElement<Stored>);
+        return dispatch_data_create(std::data(*stored), size, nullptr, ^ {
+            delete stored;
+        });
+    }
+    
     /**
      @function 
      Coroutine version of `dispatch_io_read`
@@ -1159,6 +5429,192 @@ inline namespace CO_DISPATCH_NS {
         });
     }
     
+    namespace Util {
+        
+        /**
+         Results delivered by a single `dispatch_io_read` call, queued for a single consumer
+         
+         The handler may run before or after the consumer asks for the next chunk so chunks are buffered until
+         taken and a consumer that arrives first parks its promise.
+         */
+        class IOReadChunks {
+        public:
+            struct Chunk {
+                DispatchIOResult result;
+                bool done;
+            };
+            using Awaitable = DispatchAwaitable<Chunk, SupportsExceptions::No>;
+            
+            static auto start(dispatch_io_t _Nonnull channel, off_t offset, size_t length, dispatch_queue_t _Nonnull queue) -> RefcntPtr<IOReadChunks> {
+                auto me = noref(new IOReadChunks(length));
+                RefcntPtr<IOReadChunks> handlerRef = me;
+                dispatch_io_read(channel, offset, length, queue, ^ (bool done, dispatch_data_t data, int error) {
+                    handlerRef->push(Chunk{DispatchIOResult(data, error), done});
+                });
+                return me;
+            }
+            
+            IOReadChunks(IOReadChunks &&) = delete;
+            
+            void addRef() const noexcept
+                { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+            void subRef() const noexcept {
+                if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+            
+            auto length() const noexcept -> size_t
+                { return m_length; }
+            
+            auto next() -> Awaitable {
+                return makeAwaitable<Chunk, SupportsExceptions::No>([this](auto promise) {
+                    std::unique_lock lock(m_mutex);
+                    if (m_head == m_chunks.size()) {
+                        m_waiter.emplace(std::move(promise));
+                        return;
+                    }
+                    auto chunk = std::move(m_chunks[m_head++]);
+                    if (m_head == m_chunks.size()) {
+                        m_chunks.clear();
+                        m_head = 0;
+                    }
+                    lock.unlock();
+                    promise.success(std::move(chunk));
+                });
+            }
+            
+        private:
+            IOReadChunks(size_t length) noexcept :
+                m_length(length)
+            {}
+            ~IOReadChunks() noexcept = default;
+            
+            void push(Chunk && chunk) {
+                std::unique_lock lock(m_mutex);
+                if (m_waiter) {
+                    auto waiter = std::move(*m_waiter);
+                    m_waiter.reset();
+                    lock.unlock();
+                    waiter.success(std::move(chunk));
+                    return;
+                }
+                m_chunks.push_back(std::move(chunk));
+            }
+            
+        private:
+            mutable std::atomic<unsigned> m_refCount = 1;
+            const size_t m_length;
+            std::mutex m_mutex;
+            std::vector<Chunk> m_chunks;
+            size_t m_head = 0;
+            std::optional<typename Awaitable::Promise> m_waiter;
+        };
+        
+        inline auto readChunks(DispatchHolder<dispatch_io_t> channel, off_t offset, size_t length, QueueHolder queue,
+                               size_t window) -> DispatchGenerator<DispatchIOResult, SupportsExceptions::No> {
+            window = std::max(window, size_t(1));
+            auto issue = [&]() {
+                auto size = std::min(length, window);
+                auto reader = IOReadChunks::start(channel, offset, size, queue);
+                offset += off_t(size);
+                length -= size;
+                return reader;
+            };
+            
+            auto current = issue();
+            auto ahead = length ? issue() : noref<IOReadChunks>(nullptr);
+            for (size_t received = 0; ; ) {
+                auto chunk = co_await current->next();
+                auto * data = chunk.result.data();
+                auto size = data ? dispatch_data_get_size(data) : 0;
+                received += size;
+                if (size || chunk.result.error())
+                    co_yield std::move(chunk.result);
+                if (!chunk.done)
+                    continue;
+                //a short window means end of file
+                if (chunk.result.error() || received < current->length() || !ahead)
+                    co_return;
+                current = std::move(ahead);
+                received = 0;
+                ahead = length ? issue() : noref<IOReadChunks>(nullptr);
+            }
+        }
+    }
+    
+    /**
+     @function
+     Streaming version of `co_dispatch_io_read`
+     
+     Produces each partial chunk of data as `dispatch_io_read` delivers it instead of waiting for the whole read to finish.
+     Use `dispatch_io_set_low_water` on the channel to control how often chunks are delivered.
+     
+     To keep memory bounded the read is issued in windows of at most `window` bytes with at most two of them in
+     flight: the one being consumed and the next one. Reading stops at the end of file, after `length` bytes
+     or on error. An error is reported in `error()` of the last chunk produced, which may have no data.
+     
+     Destroying the generator before it is exhausted stops issuing new windows but reads already in flight
+     run to completion.
+     */
+    inline auto co_dispatch_io_read_chunks(dispatch_io_t _Nonnull channel, off_t offset, size_t length, dispatch_queue_t _Nonnull queue,
+                                           size_t window = 1024 * 1024) -> DispatchGenerator<DispatchIOResult, SupportsExceptions::No> {
+        //the generator starts suspended so retain the arguments before it does
+        return Util::readChunks(Util::DispatchHolder<dispatch_io_t>(channel), offset, length, Util::QueueHolder(queue), window);
+    }
+    
+    /**
+     @function
+     Splits a stream of chunks, such as one produced by `co_dispatch_io_read_chunks`, into delimited records
+     
+     Produces every record without its delimiter, including empty ones between adjacent delimiters. The final
+     record is produced even if it is not terminated. Delimiters are located with `memchr` which is vectorized
+     by the C library. Records that lie within a single region of the chunk data are produced as views into it
+     without copying. Only records that straddle a region or chunk boundary are assembled in an internal buffer.
+     In either case a record remains valid only until the iterator advances.
+     
+     Splitting stops at the first chunk with an error, after producing the records of its data, if any. If `error` is
+     not null it receives the error number or 0 if there was none. It must remain valid until iteration ends.
+     */
+    template<SupportsExceptions E>
+    auto splitRecords(DispatchGenerator<DispatchIOResult, E> source, char delimiter = '\n', int * _Nullable error = nullptr)
+        -> DispatchGenerator<std::string_view, E> {
+        
+        if (error)
+            *error = 0;
+        std::string partial;
+        for (auto it = co_await std::move(source).beginSync(); it; ) {
+            auto chunk = *it;
+            auto bytes = chunk.bytes();
+            for (auto region: bytes.regions()) {
+                auto * first = reinterpret_cast<const char *>(region.data());
+                auto * const last = first + region.size();
+                while (first != last) {
+                    auto * found = static_cast<const char *>(std::memchr(first, delimiter, size_t(last - first)));
+                    if (!found) {
+                        partial.append(first, last);
+                        break;
+                    }
+                    if (partial.empty()) {
+                        co_yield std::string_view(first, size_t(found - first));
+                    } else {
+                        partial.append(first, found);
+                        co_yield std::string_view(partial);
+                        partial.clear();
+                    }
+                    first = found + 1;
+                }
+            }
+            if (chunk.error()) {
+                if (error)
+                    *error = chunk.error();
+                break;
+            }
+            co_await it.next();
+        }
+        if (!partial.empty())
+            co_yield std::string_view(partial);
+    }
+    
     /**
      @function 
      Coroutine version of `dispatch_read`
@@ -1193,6 +5649,147 @@ inline namespace CO_DISPATCH_NS {
         });
     }
     
+    /**
+     @function
+     Coroutine version of `dispatch_io_write` for data in a container
+     
+     The container is moved into dispatch data via `makeDispatchData` so its contents are not copied.
+     DispatchIOResult::data() of the result refers to it if not everything could be written.
+     */
+    template<class Container>
+    requires(Util::DispatchDataStorage<Container>)
+    auto co_dispatch_io_write(dispatch_io_t _Nonnull channel, off_t offset, Container && container, dispatch_queue_t _Nonnull queue, dispatch_io_handler_t _Nullable progressHandler = nullptr) {
+        auto data = makeDispatchData(std::move(container));
+        //dispatch_io_write retains the data for as long as it needs it
+        auto ret = co_dispatch_io_write(channel, offset, data, queue, progressHandler);
+#if !OS_OBJECT_USE_OBJC
+        dispatch_release(data);
+#endif
+        return ret;
+    }
+    
+    namespace Util {
+        
+        /**
+         Appends a fragment to gathered data
+         
+         Consumes the reference to `gathered` and returns a retained result.
+         */
+        inline auto appendData(dispatch_data_t _Nonnull gathered, dispatch_data_t _Nonnull fragment) -> dispatch_data_t _Nonnull {
+            auto ret = dispatch_data_create_concat(gathered, fragment);
+#if !OS_OBJECT_USE_OBJC
+            dispatch_release(gathered);
+#endif
+            return ret;
+        }
+        
+        /**
+         Writes gathered data consuming the reference to it
+         */
+        inline auto writeGathered(dispatch_io_t _Nonnull channel, off_t offset, dispatch_data_t _Nonnull data, dispatch_queue_t _Nonnull queue, dispatch_io_handler_t _Nullable progressHandler) {
+            //dispatch_io_write retains the data for as long as it needs it
+            auto ret = co_dispatch_io_write(channel, offset, data, queue, progressHandler);
+#if !OS_OBJECT_USE_OBJC
+            dispatch_release(data);
+#endif
+            return ret;
+        }
+        
+        /**
+         Progress of a scattered read through the caller's buffers
+         */
+        struct IOScatter {
+            std::vector<std::span<std::byte>> buffers;
+            size_t index = 0;
+            size_t offset = 0;
+            size_t transferred = 0;
+            
+            void consume(dispatch_data_t _Nullable data) {
+                if (!data)
+                    return;
+                DispatchDataView view(data);
+                for (auto region: view.regions()) {
+                    while (!region.empty() && index < buffers.size()) {
+                        auto dest = buffers[index].subspan(offset);
+                        auto count = std::min(dest.size(), region.size());
+                        std::copy_n(region.data(), count, dest.data());
+                        region = region.subspan(count);
+                        transferred += count;
+                        if ((offset += count) == buffers[index].size()) {
+                            ++index;
+                            offset = 0;
+                        }
+                    }
+                }
+            }
+        };
+    }
+    
+    /**
+     @function
+     Writes multiple fragments with a single `dispatch_io_write`
+     
+     The fragments are concatenated into one dispatch data object, which doesn't copy them, so the whole
+     list is written by one operation with one resumption of the awaiting coroutine.
+     @return DispatchIOResult object with operation result
+     */
+    inline auto co_dispatch_io_writev(dispatch_io_t _Nonnull channel, off_t offset, std::span<const dispatch_data_t> fragments, dispatch_queue_t _Nonnull queue, dispatch_io_handler_t _Nullable progressHandler = nullptr) {
+        dispatch_data_t data = dispatch_data_empty;
+        for (auto fragment: fragments)
+            data = Util::appendData(data, fragment);
+        return Util::writeGathered(channel, offset, data, queue, progressHandler);
+    }
+    
+    /**
+     @function
+     Writes multiple memory buffers with a single `dispatch_io_write`
+     
+     The buffers are not copied. They must remain valid until the operation completes, even if the returned
+     awaitable is abandoned without being awaited.
+     @return DispatchIOResult object with operation result
+     */
+    inline auto co_dispatch_io_writev(dispatch_io_t _Nonnull channel, off_t offset, std::span<const std::span<const std::byte>> fragments, dispatch_queue_t _Nonnull queue, dispatch_io_handler_t _Nullable progressHandler = nullptr) {
+        dispatch_data_t data = dispatch_data_empty;
+        for (auto fragment: fragments) {
+            auto piece = dispatch_data_create(fragment.data(), fragment.size(), nullptr, ^ {});
+            data = Util::appendData(data, piece);
+#if !OS_OBJECT_USE_OBJC
+            dispatch_release(piece);
+#endif
+        }
+        return Util::writeGathered(channel, offset, data, queue, progressHandler);
+    }
+    
+    /**
+     @function
+     Reads data into multiple caller provided buffers with a single `dispatch_io_read`
+     
+     The buffers are filled in order as data arrives and the awaiting coroutine is resumed once when the read completes.
+     Fewer bytes than the total size of the buffers are read if the end of file is reached.
+     The buffers must remain valid until the operation completes, even if the returned awaitable is abandoned
+     without being awaited.
+     @return DispatchIOTransferResult object with the number of bytes read and error, if any
+     */
+    inline auto co_dispatch_io_readv(dispatch_io_t _Nonnull channel, off_t offset, std::span<const std::span<std::byte>> buffers, dispatch_queue_t _Nonnull queue) {
+        return makeAwaitable<DispatchIOTransferResult, SupportsExceptions::No>([channel, offset, buffers, queue](auto promise) {
+            size_t length = 0;
+            for (auto buffer: buffers)
+                length += buffer.size();
+            if (length == 0) {
+                promise.success(0, 0);
+                return;
+            }
+            auto * scatter = new Util::IOScatter{{buffers.begin(), buffers.end()}};
+            dispatch_io_read(channel, offset, length, queue, ^ (bool done, dispatch_data_t data, int error){
+                scatter->consume(data);
+                if (done) {
+                    promise.success(scatter->transferred, error);
+                    delete scatter;
+                }
+            });
+        });
+    }
+    
     /**
      @function 
      Coroutine version of `dispatch_write`
@@ -1207,6 +5804,498 @@ inline namespace CO_DISPATCH_NS {
         });
     }
     
+    /**
+     @function
+     Coroutine version of `dispatch_write` for data in a container
+     
+     The container is moved into dispatch data via `makeDispatchData` so its contents are not copied.
+     */
+    template<class Container>
+    requires(Util::DispatchDataStorage<Container>)
+    auto co_dispatch_write(dispatch_fd_t fd, Container && container, dispatch_queue_t _Nonnull queue) {
+        auto data = makeDispatchData(std::move(container));
+        //dispatch_write retains the data for as long as it needs it
+        auto ret = co_dispatch_write(fd, data, queue);
+#if !OS_OBJECT_USE_OBJC
+        dispatch_release(data);
+#endif
+        return ret;
+    }
+    
+    //MARK: - File descriptor readiness
+    
+    namespace Util {
+        
+        struct FdWaiter {
+            FdWaiter * _Nullable next = nullptr;
+            ResumeTarget target;
+            bool ready = false;
+        };
+        
+        /**
+         Dispatch sources watching a single file descriptor
+         
+         Each direction has one source, created on first use and reused by all subsequent waits. Sources are
+         level triggered so a source with nobody waiting is suspended rather than left to fire continuously.
+         The sources are only cancelled by `stop()` which must be called before the descriptor is closed.
+         */
+        class FdWatch {
+        public:
+            enum Direction : unsigned {
+                read = 0,
+                write = 1
+            };
+            
+            FdWatch(int fd) noexcept :
+                m_fd(fd),
+                m_sides{{this, read}, {this, write}}
+            {}
+            FdWatch(FdWatch &&) = delete;
+            
+            void addRef() const noexcept
+                { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+            void subRef() const noexcept {
+                if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+            
+            /**
+             @returns false if the watch has been stopped. The waiter is not added in this case.
+             */
+            auto wait(Direction direction, FdWaiter * _Nonnull waiter) noexcept -> bool {
+                std::lock_guard lock(m_mutex);
+                if (m_stopped)
+                    return false;
+                auto & side = m_sides[direction];
+                if (!side.source)
+                    createSource(side);
+                waiter->next = side.waiters;
+                side.waiters = waiter;
+                if (!side.active) {
+                    side.active = true;
+                    dispatch_resume(side.source);
+                }
+                return true;
+            }
+            
+            /**
+             Cancels the sources and resumes all waiters as not ready
+             
+             onStopped is called with ctx once the sources have been cancelled and the descriptor can be closed.
+             This can happen synchronously if there are no sources.
+             */
+            void stop(void * _Nullable ctx, dispatch_function_t _Nonnull onStopped) noexcept {
+                FdWaiter * waiters[2];
+                bool pending;
+                {
+                    std::lock_guard lock(m_mutex);
+                    m_stopped = true;
+                    for (auto & side: m_sides) {
+                        waiters[side.direction] = std::exchange(side.waiters, nullptr);
+                        if (!side.source)
+                            continue;
+                        ++m_pendingCancels;
+                        //cancellation handler of a suspended source is never called
+                        if (!side.active) {
+                            side.active = true;
+                            dispatch_resume(side.source);
+                        }
+                        dispatch_source_cancel(side.source);
+                    }
+                    pending = m_pendingCancels != 0;
+                    if (pending) {
+                        m_onStopped = onStopped;
+                        m_onStoppedContext = ctx;
+                    }
+                }
+                for (auto * list: waiters)
+                    resumeAll(list, false);
+                if (!pending)
+                    onStopped(ctx);
+            }
+            
+        private:
+            struct Side {
+                FdWatch * _Nonnull owner;
+                Direction direction;
+                dispatch_source_t _Nullable source = nullptr;
+                FdWaiter * _Nullable waiters = nullptr;
+                bool active = false;
+            };
+            
+            ~FdWatch() noexcept = default;
+            
+            void createSource(Side & side) noexcept {
+                side.source = dispatch_source_create(side.direction == read ? DISPATCH_SOURCE_TYPE_READ : DISPATCH_SOURCE_TYPE_WRITE,
+                                                     uintptr_t(m_fd), 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+                dispatch_set_context(side.source, &side);
+                dispatch_source_set_event_handler_f(side.source, [](void * _Nullable ctx) {
+                    auto * side = static_cast<Side *>(ctx);
+                    side->owner->onEvent(*side);
+                });
+                dispatch_source_set_cancel_handler_f(side.source, [](void * _Nullable ctx) {
+                    auto * side = static_cast<Side *>(ctx);
+                    side->owner->onCancelled(*side);
+                });
+                //released when the source is cancelled
+                addRef();
+            }
+            
+            void onEvent(Side & side) noexcept {
+                FdWaiter * waiters;
+                {
+                    std::lock_guard lock(m_mutex);
+                    if (m_stopped)
+                        return;
+                    waiters = std::exchange(side.waiters, nullptr);
+                    if (side.active) {
+                        side.active = false;
+                        dispatch_suspend(side.source);
+                    }
+                }
+                resumeAll(waiters, true);
+            }
+            
+            void onCancelled(Side & side) noexcept {
+                dispatch_function_t _Nullable onStopped = nullptr;
+                void * _Nullable ctx = nullptr;
+                {
+                    std::lock_guard lock(m_mutex);
+#if !OS_OBJECT_USE_OBJC
+                    dispatch_release(side.source);
+#endif
+                    side.source = nullptr;
+                    if (--m_pendingCancels == 0) {
+                        onStopped = std::exchange(m_onStopped, nullptr);
+                        ctx = m_onStoppedContext;
+                    }
+                }
+                if (onStopped)
+                    onStopped(ctx);
+                subRef();
+            }
+            
+            static void resumeAll(FdWaiter * _Nullable waiter, bool ready) noexcept {
+                while (waiter) {
+                    //the waiter lives in the coroutine frame and may be gone once resumed
+                    auto * next = waiter->next;
+                    waiter->ready = ready;
+                    waiter->target.resumeAsync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+                    waiter = next;
+                }
+            }
+            
+        private:
+            mutable std::atomic<unsigned> m_refCount = 1;
+            const int m_fd;
+            std::mutex m_mutex;
+            Side m_sides[2];
+            bool m_stopped = false;
+            unsigned m_pendingCancels = 0;
+            dispatch_function_t _Nullable m_onStopped = nullptr;
+            void * _Nullable m_onStoppedContext = nullptr;
+        };
+        
+        /**
+         Process-wide map from file descriptors to their watches
+         */
+        class FdWatchRegistry {
+        public:
+            static auto shared() noexcept -> FdWatchRegistry & {
+                //intentionally leaked like TimerWheel
+                static FdWatchRegistry * const instance = new FdWatchRegistry;
+                return *instance;
+            }
+            
+            auto watch(int fd) -> RefcntPtr<FdWatch> {
+                std::lock_guard lock(m_mutex);
+                auto it = m_watches.find(fd);
+                if (it == m_watches.end())
+                    it = m_watches.emplace(fd, noref(new FdWatch(fd))).first;
+                return it->second;
+            }
+            
+            auto take(int fd) noexcept -> RefcntPtr<FdWatch> {
+                std::lock_guard lock(m_mutex);
+                auto it = m_watches.find(fd);
+                if (it == m_watches.end())
+                    return noref<FdWatch>(nullptr);
+                auto ret = std::move(it->second);
+                m_watches.erase(it);
+                return ret;
+            }
+            
+        private:
+            std::mutex m_mutex;
+            std::unordered_map<int, RefcntPtr<FdWatch>> m_watches;
+        };
+        
+        /**
+         Awaiter of `readable` and `writable`
+         */
+        class FdReadinessAwaiter : private FdWaiter {
+        public:
+            FdReadinessAwaiter(int fd, FdWatch::Direction direction, dispatch_queue_t _Nonnull queue) noexcept :
+                FdWaiter{nullptr, ResumeTarget{QueueHolder{queue}, DISPATCH_TIME_NOW, {}}, false},
+                m_fd(fd),
+                m_direction(direction)
+            {}
+            FdReadinessAwaiter(FdReadinessAwaiter &&) = delete;
+            
+            constexpr auto await_ready() const noexcept -> bool
+                { return false; }
+            
+            auto await_suspend(std::coroutine_handle<> h) -> bool {
+                this->target.handle = h;
+                m_watch = FdWatchRegistry::shared().watch(m_fd);
+                if (m_watch->wait(m_direction, this))
+                    return true;
+                return this->target.resume() != h;
+            }
+            
+            auto await_resume() const noexcept -> bool
+                { return this->ready; }
+            
+        private:
+            int m_fd;
+            FdWatch::Direction m_direction;
+            RefcntPtr<FdWatch> m_watch = noref<FdWatch>(nullptr);
+        };
+    }
+    
+    /**
+     @function
+     `co_await`ing this suspends the coroutine until the file descriptor is readable
+     
+     Unlike `co_dispatch_read` this does not read anything so you can do non-blocking `read` or `recv` directly
+     into your own buffers. A `DISPATCH_SOURCE_TYPE_READ` source is created the first time a descriptor is
+     waited on and reused by subsequent waits. Call `stopWatching` before closing the descriptor.
+     
+     The coroutine is resumed on the given queue. `co_await` produces `true` once the descriptor is readable
+     and `false` if `stopWatching` was called for it.
+     */
+    inline auto readable(int fd, dispatch_queue_t _Nonnull queue) noexcept {
+        return Util::FdReadinessAwaiter(fd, Util::FdWatch::read, queue);
+    }
+    
+    /**
+     @function
+     `co_await`ing this suspends the coroutine until the file descriptor is writable
+     
+     Behaves like `readable` but uses a `DISPATCH_SOURCE_TYPE_WRITE` source.
+     */
+    inline auto writable(int fd, dispatch_queue_t _Nonnull queue) noexcept {
+        return Util::FdReadinessAwaiter(fd, Util::FdWatch::write, queue);
+    }
+    
+    /**
+     @function
+     Releases the dispatch sources used by `readable` and `writable` for a file descriptor
+     
+     Coroutines currently waiting on the descriptor are resumed and their `co_await` produces `false`.
+     The descriptor must not be closed until `co_await`ing the result completes.
+     */
+    inline auto stopWatching(int fd) {
+        return makeAwaitable<void, SupportsExceptions::No>([fd](auto promise) {
+            using Promise = decltype(promise);
+            if (auto watch = Util::FdWatchRegistry::shared().take(fd)) {
+                watch->stop(new Promise(std::move(promise)), [](void * _Nullable ctx) {
+                    std::unique_ptr<Promise> promise(static_cast<Promise *>(ctx));
+                    promise->success();
+                });
+            } else {
+                promise.success();
+            }
+        });
+    }
+    
+    //MARK: - Sockets
+    
+    /**
+     Non-blocking stream socket for coroutines
+     
+     Wraps a connected or listening stream socket such as AF_UNIX or loopback TCP. Data moves directly between
+     the socket and caller provided buffers without going through `dispatch_data_t`, so buffers can be reused
+     across reads and writes. Waiting is done via `readable` and `writable` and always resumes on a serial
+     queue owned by the socket. Coroutines awaiting the operations below continue on that queue if the
+     operation had to wait and on their original queue otherwise.
+     
+     The socket owns its descriptor. When the socket is destroyed the descriptor is closed once the dispatch
+     sources watching it are released. No operation may be in progress at that point or when the socket is moved.
+     */
+    class DispatchSocket {
+    public:
+        /**
+         Creates an invalid socket
+         */
+        DispatchSocket() noexcept = default;
+        
+        /**
+         Takes ownership of a socket descriptor and puts it into non-blocking mode
+         */
+        explicit DispatchSocket(int fd) noexcept :
+            m_fd(fd) {
+            
+            m_queue = dispatch_queue_create("objc-helpers.socket", DISPATCH_QUEUE_SERIAL);
+#if !OS_OBJECT_USE_OBJC
+            dispatch_release(m_queue);
+#endif
+            if (int flags = fcntl(m_fd, F_GETFL); flags != -1 && !(flags & O_NONBLOCK))
+                fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            setsockopt(m_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        }
+        
+        DispatchSocket(DispatchSocket && src) noexcept :
+            m_fd(std::exchange(src.m_fd, -1)),
+            m_queue(std::move(src.m_queue))
+        {}
+        
+        auto operator=(DispatchSocket && src) noexcept -> DispatchSocket & {
+            if (this != &src) {
+                close();
+                m_fd = std::exchange(src.m_fd, -1);
+                m_queue = std::move(src.m_queue);
+            }
+            return *this;
+        }
+        
+        ~DispatchSocket() noexcept
+            { close(); }
+        
+        explicit operator bool() const noexcept
+            { return m_fd != -1; }
+        
+        /**
+         The underlying descriptor or -1 for an invalid socket
+         */
+        auto fd() const noexcept -> int
+            { return m_fd; }
+        
+        /**
+         Queue on which operations resume after waiting
+         */
+        auto queue() const noexcept -> dispatch_queue_t _Nullable
+            { return m_queue; }
+        
+        /**
+         Accepts a connection on a listening socket
+         
+         `co_await` produces the accepted socket and 0 or an invalid socket and the error number.
+         */
+        auto accept() -> DispatchTask<std::pair<DispatchSocket, int>> {
+            for ( ; ; ) {
+                int fd = ::accept(m_fd, nullptr, nullptr);
+                if (fd != -1)
+                    co_return std::pair{DispatchSocket(fd), 0};
+                int err = errno;
+                if (err == EINTR)
+                    continue;
+                if (err != EAGAIN)
+                    co_return std::pair{DispatchSocket(), err};
+                if (!co_await readable(m_fd, m_queue))
+                    co_return std::pair{DispatchSocket(), ECANCELED};
+            }
+        }
+        
+        /**
+         Reads whatever is available, waiting for at least 1 byte
+         
+         `transferred()` of the result is 0 and `error()` is 0 at the end of the stream.
+         */
+        auto readSome(std::span<std::byte> buffer) -> DispatchTask<DispatchIOTransferResult> {
+            for ( ; ; ) {
+                auto received = ::recv(m_fd, buffer.data(), buffer.size(), 0);
+                if (received >= 0)
+                    co_return DispatchIOTransferResult(size_t(received), 0);
+                int err = errno;
+                if (err == EINTR)
+                    continue;
+                if (err != EAGAIN)
+                    co_return DispatchIOTransferResult(0, err);
+                if (!co_await readable(m_fd, m_queue))
+                    co_return DispatchIOTransferResult(0, ECANCELED);
+            }
+        }
+        
+        /**
+         Writes the whole buffer
+         
+         On error `transferred()` of the result is the number of bytes written before it occurred.
+         */
+        auto writeAll(std::span<const std::byte> buffer) -> DispatchTask<DispatchIOTransferResult> {
+            size_t sent = 0;
+            while (sent < buffer.size()) {
+                auto res = ::send(m_fd, buffer.data() + sent, buffer.size() - sent, s_sendFlags);
+                if (res >= 0) {
+                    sent += size_t(res);
+                    continue;
+                }
+                int err = errno;
+                if (err == EINTR)
+                    continue;
+                if (err != EAGAIN)
+                    co_return DispatchIOTransferResult(sent, err);
+                if (!co_await writable(m_fd, m_queue))
+                    co_return DispatchIOTransferResult(sent, ECANCELED);
+            }
+            co_return DispatchIOTransferResult(sent, 0);
+        }
+        
+        /**
+         Shuts down one or both directions of the connection
+         
+         @param how one of `SHUT_RD`, `SHUT_WR` or `SHUT_RDWR`
+         @return 0 on success or the error number
+         */
+        auto shutdown(int how = SHUT_WR) noexcept -> int
+            { return ::shutdown(m_fd, how) == 0 ? 0 : errno; }
+        
+    private:
+        void close() noexcept {
+            if (m_fd == -1)
+                return;
+            int fd = std::exchange(m_fd, -1);
+            m_queue = nullptr;
+            if (auto watch = Util::FdWatchRegistry::shared().take(fd)) {
+                watch->stop(reinterpret_cast<void *>(intptr_t(fd)), [](void * _Nullable ctx) {
+                    ::close(int(intptr_t(ctx)));
+                });
+            } else {
+                ::close(fd);
+            }
+        }
+        
+    private:
+#ifdef MSG_NOSIGNAL
+        static constexpr int s_sendFlags = MSG_NOSIGNAL;
+#else
+        static constexpr int s_sendFlags = 0;
+#endif
+        int m_fd = -1;
+        Util::QueueHolder m_queue;
+    };
+    
+#if CO_DISPATCH_TRACE
+    
+    //MARK: - Tracing
+    
+    /**
+     Returns coroutine lifecycle events recorded since the previous call as Chrome trace event format JSON
+     
+     Only available when compiled with CO_DISPATCH_TRACE=1. The result can be loaded into Perfetto or chrome://tracing.
+     Each coroutine promise appears as a "task" async span from creation to completion. Every asynchronous resumption
+     appears as a "queued" async span covering the time spent waiting in a dispatch queue followed by a "run" slice on
+     the thread that ran it. Events are buffered per thread without locking until this function drains them.
+     */
+    inline auto drainDispatchTrace() -> std::string {
+        return Util::TraceRegistry::shared().drainJSON();
+    }
+    
+#endif
+    
 }
 
 #pragma clang diagnostic pop
@@ -7,7 +7,20 @@
 #endif
 
 #include <filesystem>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
+#include <array>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#if __cpp_lib_memory_resource
+    #include <memory_resource>
+#endif
 
 #include "TestGlobal.h"
 
@@ -106,15 +119,1439 @@ static auto checkIO() -> DispatchTask<> {
         CHECK(res1.error() == res.error());
     }
     
+    {
+        int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(rfd);
+        
+        auto serial = dispatch_queue_create("chunks", DISPATCH_QUEUE_SERIAL);
+        dispatch_io_t rch = dispatch_io_create(DISPATCH_IO_RANDOM, rfd, conq, ^(int /*error*/) {
+            close(rfd);
+        });
+        dispatch_io_set_low_water(rch, 4);
+        
+        auto readAll = [&](size_t length) -> DispatchTask<std::string> {
+            std::string res;
+            int chunks = 0;
+            for (auto it = co_await co_dispatch_io_read_chunks(rch, 0, length, serial, 6).beginOn(conq); it; co_await it.next()) {
+                auto chunk = *it;
+                CHECK(!chunk.error());
+                auto bytes = chunk.bytes();
+                for (auto region: bytes.regions())
+                    res.append(reinterpret_cast<const char *>(region.data()), region.size());
+                ++chunks;
+            }
+            CHECK(chunks > 1);
+            co_return res;
+        };
+        
+        CHECK(co_await readAll(SIZE_MAX) == "hello world yada");
+        CHECK(co_await readAll(11) == "hello world");
+        
+        //abandoned mid-way
+        {
+            auto gen = co_dispatch_io_read_chunks(rch, 0, SIZE_MAX, serial, 6);
+            auto it = co_await std::move(gen).beginOn(conq);
+            CHECK(it);
+        }
+        
+        dispatch_io_close(rch, 0);
+        dispatch_release(rch);
+        dispatch_release(serial);
+    }
+    
+    {
+        int wfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(wfd);
+        auto res = co_await co_dispatch_write(wfd, std::string("one\ntwo\n\na record longer than a chunk\nlast"), conq);
+        close(wfd);
+        REQUIRE(!res.error());
+        
+        int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(rfd);
+        dispatch_io_t rch = dispatch_io_create(DISPATCH_IO_RANDOM, rfd, conq, ^(int /*error*/) {
+            close(rfd);
+        });
+        dispatch_io_set_low_water(rch, 4);
+        
+        std::vector<std::string> records;
+        int error = -1;
+        auto lines = splitRecords(co_dispatch_io_read_chunks(rch, 0, SIZE_MAX, conq, 8), '\n', &error);
+        //the generator retains the channel even though it has not started yet
+        dispatch_release(rch);
+        for (auto it = co_await std::move(lines).beginOn(conq); it; co_await it.next())
+            records.emplace_back(*it);
+        CHECK(error == 0);
+        CHECK(records == std::vector<std::string>{"one", "two", "", "a record longer than a chunk", "last"});
+    }
+    
+    {
+        std::vector<char> vec{'z', 'e', 'r', 'o'};
+        auto * vecBytes = vec.data();
+        auto data = makeDispatchData(std::move(vec));
+        static bool sameBytes = false;
+        dispatch_data_apply(data, ^ (dispatch_data_t, size_t, const void * buf, size_t size) {
+            sameBytes = (buf == vecBytes && size == 4);
+            return true;
+        });
+        CHECK(sameBytes);
+        dispatch_release(data);
+        
+        int wfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(wfd);
+        std::vector<char> zero{'z', 'e', 'r', 'o'};
+        auto res = co_await co_dispatch_write(wfd, std::move(zero), conq);
+        REQUIRE(!res.error());
+        dispatch_io_t wch = dispatch_io_create(DISPATCH_IO_STREAM, wfd, conq, ^(int /*error*/) {
+            close(wfd);
+        });
+        res = co_await co_dispatch_io_write(wch, 4, std::string(" copy with a string long enough to be on the heap"), conq);
+        REQUIRE(!res.error());
+        res = co_await co_dispatch_io_write(wch, 53, std::string(), conq);
+        REQUIRE(!res.error());
+        dispatch_io_close(wch, 0);
+        dispatch_release(wch);
+        
+        int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(rfd);
+        res = co_await co_dispatch_read(rfd, 100, conq);
+        close(rfd);
+        REQUIRE(!res.error());
+        const void * realData;
+        size_t realSize;
+        auto mapped = dispatch_data_create_map(res.data(), &realData, &realSize);
+        CHECK(std::string(static_cast<const char *>(realData), realSize) == "zero copy with a string long enough to be on the heap");
+        dispatch_release(mapped);
+    }
+    
+    {
+        auto part1 = dispatch_data_create("hel", 3, conq, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        auto part2 = dispatch_data_create("lo", 2, conq, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        auto part3 = dispatch_data_create(" world", 6, conq, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        auto temp = dispatch_data_create_concat(part1, part2);
+        auto data = dispatch_data_create_concat(temp, part3);
+        dispatch_release(temp);
+        dispatch_release(part1);
+        dispatch_release(part2);
+        dispatch_release(part3);
+        
+        DispatchDataView view(data);
+        dispatch_release(data);
+        
+        CHECK(view.regions().size() == 3);
+        CHECK(view.size() == 11);
+        std::string str;
+        std::transform(view.begin(), view.end(), std::back_inserter(str), [](std::byte b) { return char(b); });
+        CHECK(str == "hello world");
+        std::string reversed;
+        for (auto it = view.end(); it != view.begin(); )
+            reversed += char(*--it);
+        CHECK(reversed == "dlrow olleh");
+        
+        const std::byte needle[] = {std::byte('l'), std::byte('o'), std::byte(' ')};
+        auto found = std::search(view.begin(), view.end(), std::begin(needle), std::end(needle));
+        CHECK(std::distance(view.begin(), found) == 3);
+        CHECK(found.contiguous().size() == 2);
+#if __cpp_lib_ranges
+        static_assert(std::bidirectional_iterator<DispatchDataView::iterator>);
+        static_assert(std::ranges::bidirectional_range<DispatchDataView>);
+        CHECK(std::ranges::count(view, std::byte('l')) == 3);
+#endif
+        
+        DispatchDataView empty(nullptr);
+        CHECK(empty.empty());
+        CHECK(empty.begin() == empty.end());
+        CHECK(DispatchIOResult(dispatch_data_empty, 0).bytes().empty());
+    }
+    
+    {
+        int wfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(wfd);
+        dispatch_io_t wch = dispatch_io_create(DISPATCH_IO_RANDOM, wfd, conq, ^(int /*error*/) {
+            close(wfd);
+        });
+        std::string header = "header|", body1 = "body1|", body2 = "body2|";
+        std::span<const std::byte> byteFragments[] = {std::as_bytes(std::span(header)), std::as_bytes(std::span(body1)), std::as_bytes(std::span(body2))};
+        auto res = co_await co_dispatch_io_writev(wch, 0, byteFragments, conq);
+        REQUIRE(!res.error());
+        dispatch_data_t dataFragments[] = {hello, world, yada};
+        res = co_await co_dispatch_io_writev(wch, 19, dataFragments, conq);
+        REQUIRE(!res.error());
+        dispatch_io_close(wch, 0);
+        dispatch_release(wch);
+        
+        int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        REQUIRE(rfd);
+        dispatch_io_t rch = dispatch_io_create(DISPATCH_IO_RANDOM, rfd, conq, ^(int /*error*/) {
+            close(rfd);
+        });
+        dispatch_io_set_low_water(rch, 4);
+        std::array<char, 7> first;
+        std::array<char, 5> second;
+        std::array<char, 100> rest;
+        std::span<std::byte> buffers[] = {std::as_writable_bytes(std::span(first)), std::as_writable_bytes(std::span(second)), std::as_writable_bytes(std::span(rest))};
+        auto readRes = co_await co_dispatch_io_readv(rch, 0, buffers, conq);
+        CHECK(!readRes.error());
+        CHECK(readRes.transferred() == 35);
+        CHECK(std::string(first.data(), first.size()) == "header|");
+        CHECK(std::string(second.data(), second.size()) == "body1");
+        CHECK(std::string(rest.data(), 23) == "|body2|hello world yada");
+        
+        readRes = co_await co_dispatch_io_readv(rch, 0, {}, conq);
+        CHECK(readRes.transferred() == 0);
+        dispatch_io_close(rch, 0);
+        dispatch_release(rch);
+    }
+    
     remove(path);
     
     co_await resumeOnMainQueue();
 }
 
+template<class T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator(std::atomic<int> * count) noexcept : count(count)
+    {}
+    template<class U>
+    CountingAllocator(const CountingAllocator<U> & src) noexcept : count(src.count)
+    {}
+
+    auto allocate(size_t n) -> T * {
+        ++*count;
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * p, size_t n) noexcept {
+        --*count;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    friend bool operator==(const CountingAllocator &, const CountingAllocator &) = default;
+
+    std::atomic<int> * count;
+};
+
+static auto allocatedChild(std::allocator_arg_t, CountingAllocator<char>, int i) -> DispatchTask<int> {
+    co_await resumeOn(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    co_return i;
+}
+
+static auto allocatedGenerator(std::allocator_arg_t, CountingAllocator<char>) -> DispatchGenerator<int> {
+    co_yield 1;
+    co_yield 2;
+}
+
+#if __cpp_lib_memory_resource
+struct CountingResource : std::pmr::memory_resource {
+    std::atomic<int> count = 0;
+private:
+    auto do_allocate(size_t bytes, size_t alignment) -> void * override {
+        ++count;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void * p, size_t bytes, size_t alignment) override {
+        --count;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    auto do_is_equal(const std::pmr::memory_resource & other) const noexcept -> bool override
+        { return this == &other; }
+};
+#endif
+
+static auto checkFramePool() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    //frames are created on main queue and destroyed on whatever worker finishes them
+    auto child = [conq](int i) -> DispatchTask<int> {
+        co_await resumeOn(conq);
+        co_return i;
+    };
+    auto bigChild = [conq](int i) -> DispatchTask<int> {
+        char buf[4096];
+        buf[i % sizeof(buf)] = char(i);
+        co_await resumeOn(conq);
+        co_return buf[i % sizeof(buf)];
+    };
+
+    int sum = 0;
+    for (int i = 0; i < 1000; ++i) {
+        sum += co_await child(i).resumeOnMainQueue();
+        sum -= co_await bigChild(i % 100).resumeOnMainQueue();
+    }
+    CHECK(sum == 999 * 1000 / 2 - 10 * (99 * 100 / 2));
+
+    std::vector<DispatchTask<int>> abandoned;
+    for (int i = 0; i < 100; ++i)
+        abandoned.push_back(child(i));
+    abandoned.clear();
+
+    {
+        std::atomic<int> count = 0;
+        auto i = co_await allocatedChild(std::allocator_arg, &count, 3).resumeOnMainQueue();
+        CHECK(i == 3);
+        CHECK(count == 0);
+
+        auto task = allocatedChild(std::allocator_arg, &count, 4);
+        CHECK(count == 1);
+        i = co_await std::move(task).resumeOnMainQueue();
+        CHECK(i == 4);
+
+        std::vector<int> res;
+        for (auto it = co_await allocatedGenerator(std::allocator_arg, &count).beginOn(conq); it; co_await it.next()) {
+            CHECK(count == 1);
+            res.push_back(*it);
+        }
+        CHECK(res == std::vector{1, 2});
+        co_await resumeOnMainQueue();
+        CHECK(count == 0);
+    }
+
+#if __cpp_lib_memory_resource
+    {
+        CountingResource resource;
+        auto member = [conq](std::allocator_arg_t, std::pmr::memory_resource *, int i) -> DispatchTask<int> {
+            co_await resumeOn(conq);
+            co_return i;
+        };
+        auto task = member(std::allocator_arg, &resource, 5);
+        CHECK(resource.count == 1);
+        auto i = co_await std::move(task).resumeOnMainQueue();
+        CHECK(i == 5);
+        CHECK(resource.count == 0);
+    }
+#endif
+
+    co_await resumeOnMainQueue();
+}
+
+static auto checkAwaitableStates() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    int sum = 0;
+    for (int i = 0; i < 1000; ++i) {
+        sum += co_await co_dispatch(conq, [i]() {
+            return i;
+        }).resumeOnMainQueue();
+    }
+    CHECK(sum == 999 * 1000 / 2);
+
+    std::array<char, 2048> big{};
+    big[100] = 5;
+    auto res = co_await co_dispatch(conq, [big]() {
+        return big[100];
+    }).resumeOnMainQueue();
+    CHECK(res == 5);
+
+    struct alignas(64) Aligned {
+        int value;
+        auto operator()() const -> int {
+            CHECK(reinterpret_cast<uintptr_t>(this) % 64 == 0);
+            return value;
+        }
+    };
+    res = co_await co_dispatch(conq, Aligned{7}).resumeOnMainQueue();
+    CHECK(res == 7);
+
+    for (int i = 0; i < 100; ++i) {
+        //abandoned before completion
+        co_dispatch(conq, [i]() {
+            return i;
+        });
+        makeAwaitable<int>([](auto promise) {
+            promise.success(1);
+        });
+    }
+}
+
+static auto checkCurrentQueueDetection() -> DispatchTask<> {
+
+    auto serial = dispatch_queue_create("serial", DISPATCH_QUEUE_SERIAL);
+
+    //If the library fails to detect it is already on the queue it will hop via dispatch_async
+    //and the block queued before will run first
+    auto queueFlag = [serial](bool & flag) {
+        dispatch_async_f(serial, &flag, [](void * ctx) {
+            *static_cast<bool *>(ctx) = true;
+        });
+    };
+    auto immediate = []() -> DispatchTask<int> {
+        co_return 1;
+    };
+
+    co_await resumeOn(serial);
+    bool flag = false;
+    queueFlag(flag);
+    auto i = co_await immediate().resumeOn(serial);
+    CHECK(i == 1);
+    CHECK(!flag);
+
+    //completion arrives on serial from co_dispatch which is not resumed via our trampolines
+    i = co_await co_dispatch(serial, [&]() {
+        queueFlag(flag = false);
+        return 2;
+    }).resumeOn(serial);
+    CHECK(i == 2);
+    CHECK(!flag);
+
+    queueFlag(flag = false);
+    co_await resumeOnIfNeeded(serial);
+    CHECK(!flag);
+    co_await resumeOn(serial);
+    CHECK(flag);
+
+    co_await resumeOnMainQueueIfNeeded();
+    CHECK(isMainQueue());
+    co_await resumeOnIfNeeded(serial);
+    CHECK(!isMainQueue());
+
+    //code running in a nested dispatch_sync onto another queue is not on serial
+    struct NestedContext {
+        dispatch_queue_t serial;
+        std::optional<DispatchTask<>> task;
+        bool resumed = false;
+        bool resumedInline = false;
+    } nested{serial};
+    auto other = dispatch_queue_create("other", DISPATCH_QUEUE_SERIAL);
+    dispatch_sync_f(other, &nested, [](void * ctx) {
+        auto & nested = *static_cast<NestedContext *>(ctx);
+        nested.task.emplace([](NestedContext & nested) -> DispatchTask<> {
+            co_await resumeOnIfNeeded(nested.serial);
+            nested.resumed = true;
+        }(nested));
+        nested.resumedInline = nested.resumed;
+    });
+    co_await std::move(*nested.task);
+    CHECK(nested.resumed);
+    CHECK(!nested.resumedInline);
+    dispatch_release(other);
+
+    co_await resumeOnMainQueue();
+    dispatch_release(serial);
+}
+
+static auto checkWhenAll() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    auto child = [conq](int i) -> DispatchTask<int> {
+        co_await resumeOn(conq);
+        co_return i;
+    };
+    auto voidChild = [conq]() -> DispatchTask<> {
+        co_await resumeOn(conq);
+    };
+    auto immediate = []() -> DispatchTask<int> {
+        co_return 3;
+    };
+
+    auto [a, b, c] = co_await whenAll(child(1), co_dispatch(conq, []() { return 2.5; }), voidChild()).resumeOnMainQueue();
+    CHECK(isMainQueue());
+    CHECK(a == 1);
+    CHECK(b == 2.5);
+    CHECK(c == std::monostate{});
+
+    auto [x, y] = co_await whenAll(immediate(), immediate());
+    CHECK(x == 3);
+    CHECK(y == 3);
+
+    std::vector<DispatchTask<int>> tasks;
+    for (int i = 0; i < 100; ++i)
+        tasks.push_back(i % 3 ? child(i) : immediate());
+    auto results = co_await whenAll(std::move(tasks)).resumeOnMainQueue();
+    REQUIRE(results.size() == 100);
+    CHECK(results[0] == 3);
+    CHECK(results[58] == 58);
+
+    std::vector<DispatchTask<>> voidTasks;
+    voidTasks.push_back(voidChild());
+    voidTasks.push_back(voidChild());
+    co_await whenAll(std::move(voidTasks)).resumeOnMainQueue();
+    co_await whenAll(std::vector<DispatchTask<>>{}).resumeOnMainQueue();
+    CHECK(isMainQueue());
+
+    //abandoned without awaiting
+    whenAll(child(1), child(2));
+
+#ifdef __cpp_exceptions
+    auto failing = [conq]() -> DispatchTask<int> {
+        co_await resumeOn(conq);
+        throw std::runtime_error("oops");
+    };
+    try {
+        co_await whenAll(child(1), failing()).resumeOnMainQueue();
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "oops");
+    }
+#endif
+}
+
+static auto checkWhenAny() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    static std::atomic<int> finishedLosers = 0;
+    auto slow = [conq](int i) -> DispatchTask<int> {
+        co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 50 * NSEC_PER_MSEC));
+        ++finishedLosers;
+        co_return i;
+    };
+    auto fast = [conq](std::string str) -> DispatchTask<std::string> {
+        co_await resumeOn(conq);
+        co_return str;
+    };
+    auto immediate = []() -> DispatchTask<int> {
+        co_return 3;
+    };
+
+    auto first = co_await whenAny(slow(1), fast("hello"), co_dispatch(conq, []() {})).resumeOnMainQueue();
+    CHECK(isMainQueue());
+    CHECK(first.index() != 0);
+    if (first.index() == 1)
+        CHECK(std::get<1>(first) == "hello");
+
+    auto sync = co_await whenAny(slow(1), immediate(), immediate());
+    CHECK(sync.index() == 1);
+    CHECK(std::get<1>(sync) == 3);
+
+    std::vector<DispatchTask<int>> tasks;
+    for (int i = 0; i < 20; ++i)
+        tasks.push_back(slow(i));
+    tasks.push_back(immediate());
+    auto [index, value] = co_await whenAny(std::move(tasks)).resumeOnMainQueue();
+    CHECK(index == 20);
+    CHECK(value == 3);
+
+    std::vector<DispatchAwaitableFor<void (*)()>> voids;
+    voids.push_back(co_dispatch(conq, []() {}));
+    auto voidIndex = co_await whenAny(std::move(voids));
+    CHECK(voidIndex == 0);
+
+    //abandoned without awaiting
+    whenAny(slow(1), slow(2));
+
+    //losers keep running to completion after the winner is returned
+    co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 200 * NSEC_PER_MSEC));
+    CHECK(finishedLosers == 24);
+
+#ifdef __cpp_exceptions
+    auto failing = [conq]() -> DispatchTask<int> {
+        co_await resumeOn(conq);
+        throw std::runtime_error("oops");
+    };
+    try {
+        co_await whenAny(slow(1), failing()).resumeOnMainQueue();
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "oops");
+    }
+    
+    CHECK_THROWS_AS(whenAny(std::vector<DispatchTask<int>>{}), std::invalid_argument);
+#endif
+}
+
+static auto checkCancellation() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    auto delayed = [conq](uint64_t ms) -> DispatchTask<int> {
+        co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, ms * NSEC_PER_MSEC));
+        co_return 1;
+    };
+
+    //default token is never cancelled
+    CHECK(co_await delayed(1).withCancellation(CancellationToken{}) == 1);
+
+    //callbacks can observe cancellation and the result is ignored
+    static std::atomic<bool> sawCancel = false;
+    auto observing = [conq](auto promise) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 50 * NSEC_PER_MSEC), conq, ^ {
+            sawCancel = promise.isCancelled();
+            promise.success(1);
+        });
+    };
+
+#ifdef __cpp_exceptions
+    {
+        CancellationSource source;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 20 * NSEC_PER_MSEC), conq, ^ {
+            source.cancel();
+        });
+        try {
+            co_await delayed(5000).withCancellation(source.token()).resumeOnMainQueue();
+            FAIL("cancellation expected");
+        } catch (DispatchCancelled &) {
+            CHECK(isMainQueue());
+        }
+        CHECK(source.isCancelled());
+    }
+
+    {
+        CancellationSource source;
+        auto awaitable = makeAwaitable<int>(observing).withCancellation(source.token());
+        source.cancel();
+        try {
+            co_await std::move(awaitable);
+            FAIL("cancellation expected");
+        } catch (DispatchCancelled &) {
+        }
+        co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+        CHECK(sawCancel);
+    }
+
+    {
+        CancellationSource source;
+        source.cancel();
+        try {
+            co_await co_dispatch(conq, []() { return 1; }).withCancellation(source.token());
+        } catch (DispatchCancelled &) {
+        }
+        try {
+            co_await whenAll(delayed(1), delayed(50).withCancellation(source.token()));
+            FAIL("cancellation expected");
+        } catch (DispatchCancelled &) {
+        }
+    }
+#endif
+
+    //without exceptions cancellation is only a hint and the result is delivered
+    {
+        sawCancel = false;
+        CancellationSource source;
+        auto awaitable = makeAwaitable<int, SupportsExceptions::No>(observing).withCancellation(source.token());
+        source.cancel();
+        CHECK(co_await std::move(awaitable) == 1);
+        CHECK(sawCancel);
+    }
+}
+
+static auto checkTaskGroup() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    static std::atomic<int> running = 0;
+    static std::atomic<int> maxRunning = 0;
+    static std::atomic<int> finished = 0;
+    auto child = [conq]() -> DispatchTask<> {
+        int now = ++running;
+        for (int prev = maxRunning; prev < now && !maxRunning.compare_exchange_weak(prev, now); ) {}
+        co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_MSEC));
+        --running;
+        ++finished;
+    };
+
+    {
+        DispatchTaskGroup group(conq, 3);
+        for (int i = 0; i < 20; ++i)
+            co_await group.spawn(child);
+        co_await group.join().resumeOnMainQueue();
+        CHECK(isMainQueue());
+        CHECK(finished == 20);
+        CHECK(maxRunning <= 3);
+        CHECK(running == 0);
+
+        //joining an idle group completes immediately
+        co_await group.join();
+    }
+
+#ifdef __cpp_exceptions
+    {
+        static std::atomic<int> started = 0;
+        static std::atomic<int> sawCancel = 0;
+        auto waiting = [conq](CancellationToken token) -> DispatchTask<> {
+            ++started;
+            while (!token.isCancelled())
+                co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 1 * NSEC_PER_MSEC));
+            ++sawCancel;
+        };
+        auto failing = [conq]() -> DispatchTask<int> {
+            co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_MSEC));
+            throw std::runtime_error("oops");
+        };
+
+        DispatchTaskGroup group(conq, 2);
+        co_await group.spawn(waiting);
+        co_await group.spawn(failing);
+        for (int i = 0; i < 10; ++i)
+            co_await group.spawn(waiting);
+        try {
+            co_await group.join();
+            FAIL("exception expected");
+        } catch (std::runtime_error & ex) {
+            CHECK(std::string(ex.what()) == "oops");
+        }
+        CHECK(started < 11);
+        CHECK(sawCancel == started);
+    }
+#endif
+}
+
+static auto checkApply() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    std::vector<std::atomic<int>> hits(10000);
+    co_await co_dispatch_apply(conq, hits.size(), [&](size_t i) noexcept {
+        ++hits[i];
+    }, 64);
+    CHECK(std::all_of(hits.begin(), hits.end(), [](auto & hit) { return hit == 1; }));
+
+    //fewer iterations than grain and no iterations at all
+    std::atomic<int> count = 0;
+    co_await co_dispatch_apply(conq, 3, [&](size_t) noexcept { ++count; }, 100).resumeOnMainQueue();
+    CHECK(isMainQueue());
+    CHECK(count == 3);
+    co_await co_dispatch_apply(conq, 0, [&](size_t) noexcept { ++count; });
+    CHECK(count == 3);
+
+#if __cpp_lib_ranges
+    std::vector<int> values(1000, 1);
+    co_await co_dispatch_apply(conq, values, [](int & val) noexcept { val *= 2; }, 10);
+    CHECK(std::all_of(values.begin(), values.end(), [](int val) { return val == 2; }));
+#endif
+
+#ifdef __cpp_exceptions
+    try {
+        co_await co_dispatch_apply(conq, 1000, [](size_t i) {
+            if (i == 500)
+                throw std::runtime_error("oops");
+        }, 10);
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "oops");
+    }
+#endif
+}
+
+#if __cpp_lib_ranges
+static auto checkTransformReduce() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    std::vector<int> values(100000);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = int(i % 100);
+    long long expected = 0;
+    for (auto val: values)
+        expected += val * val;
+
+    auto sum = co_await parallelTransformReduce(conq, values, 0LL, std::plus<>{}, [](int val) {
+        return (long long)val * val;
+    });
+    CHECK(sum == expected);
+
+    sum = co_await parallelTransformReduce(conq, values, 5LL, std::plus<>{}, [](int val) {
+        return (long long)val * val;
+    }, 7).resumeOnMainQueue();
+    CHECK(isMainQueue());
+    CHECK(sum == expected + 5);
+
+    std::vector<std::string> empty;
+    auto joined = co_await parallelTransformReduce(conq, empty, std::string("init"), std::plus<>{}, [](const std::string & str) {
+        return str;
+    });
+    CHECK(joined == "init");
+
+#ifdef __cpp_exceptions
+    try {
+        co_await parallelTransformReduce(conq, values, 0, std::plus<>{}, [](int val) {
+            if (val == 50)
+                throw std::runtime_error("oops");
+            return val;
+        });
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "oops");
+    }
+
+    //on a serial queue workers run one after another so nothing runs after the first element throws
+    auto serial = dispatch_queue_create("transformReduce", DISPATCH_QUEUE_SERIAL);
+    size_t transformed = 0;
+    try {
+        co_await parallelTransformReduce(serial, values, 0, std::plus<>{}, [&](int val) {
+            ++transformed;
+            if (val == 0)
+                throw std::runtime_error("first");
+            return val;
+        }, 10);
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "first");
+    }
+    CHECK(transformed == 1);
+    dispatch_release(serial);
+#endif
+}
+#endif
+
+static auto checkChannel() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    {
+        DispatchChannel<int> channel(2);
+        CHECK(channel.capacity() == 2);
+        CHECK(co_await channel.send(1));
+        CHECK(co_await channel.send(2));
+        CHECK(co_await channel.receive() == 1);
+        CHECK(co_await channel.receive() == 2);
+        channel.close();
+        CHECK(!co_await channel.send(3));
+        CHECK(co_await channel.receive() == std::nullopt);
+    }
+
+    {
+        //values buffered before closing are all received
+        DispatchChannel<int> channel(4);
+        for (int i = 1; i <= 3; ++i)
+            CHECK(co_await channel.send(i));
+        channel.close();
+        for (int i = 1; i <= 3; ++i)
+            CHECK(co_await channel.receive() == i);
+        CHECK(co_await channel.receive() == std::nullopt);
+        CHECK(co_await channel.receive() == std::nullopt);
+    }
+
+    {
+        constexpr int producerCount = 4;
+        constexpr int consumerCount = 3;
+        constexpr int perProducer = 2000;
+
+        DispatchChannel<std::unique_ptr<int>> channel(8, conq);
+        static std::atomic<long long> received = 0;
+        static std::atomic<int> receivedCount = 0;
+        received = 0;
+        receivedCount = 0;
+
+        auto producer = [conq](DispatchChannel<std::unique_ptr<int>> & channel, int base) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            for (int i = 0; i < perProducer; ++i)
+                co_await channel.send(std::make_unique<int>(base + i));
+        };
+        auto consumer = [conq](DispatchChannel<std::unique_ptr<int>> & channel) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            while (auto value = co_await channel.receive()) {
+                received += **value;
+                ++receivedCount;
+            }
+        };
+
+        std::vector<DispatchTask<>> consumers;
+        for (int i = 0; i < consumerCount; ++i)
+            consumers.push_back(consumer(channel));
+        std::vector<DispatchTask<>> producers;
+        for (int i = 0; i < producerCount; ++i)
+            producers.push_back(producer(channel, i * perProducer));
+        co_await whenAll(std::move(producers));
+        channel.close();
+        co_await whenAll(std::move(consumers));
+
+        long long total = producerCount * perProducer;
+        CHECK(receivedCount == total);
+        CHECK(received == total * (total - 1) / 2);
+    }
+}
+
+static auto checkAsyncLocks() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    {
+        AsyncMutex mutex;
+        CHECK(mutex.tryLock());
+        CHECK(!mutex.tryLock());
+        mutex.unlock();
+
+        static int counter = 0;
+        static std::atomic<int> inside = 0;
+        static std::atomic<bool> overlapped = false;
+        counter = 0;
+        auto worker = [conq](AsyncMutex & mutex) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            for (int i = 0; i < 200; ++i) {
+                auto guard = co_await mutex.scopedLock();
+                if (++inside != 1)
+                    overlapped = true;
+                int value = counter;
+                if (i % 50 == 0)
+                    co_await resumeOn(conq);
+                counter = value + 1;
+                --inside;
+            }
+        };
+        std::vector<DispatchTask<>> workers;
+        for (int i = 0; i < 8; ++i)
+            workers.push_back(worker(mutex));
+        co_await whenAll(std::move(workers));
+        CHECK(counter == 8 * 200);
+        CHECK(!overlapped);
+
+        //a coroutine that had to wait ends up on the requested queue
+        co_await mutex.lock();
+        auto waiter = [](AsyncMutex & mutex) -> DispatchTask<bool> {
+            co_await mutex.lock().resumeOnMainQueue();
+            bool onMain = isMainQueue();
+            mutex.unlock();
+            co_return onMain;
+        };
+        auto waiting = waiter(mutex);
+        co_await resumeOn(conq);
+        mutex.unlock();
+        CHECK(co_await std::move(waiting));
+
+        //a long line of waiters that never suspend while holding the lock does not nest on one stack
+        co_await mutex.lock();
+        static int served = 0;
+        served = 0;
+        auto quick = [](AsyncMutex & mutex) -> DispatchTask<> {
+            co_await mutex.lock();
+            ++served;
+            mutex.unlock();
+        };
+        std::vector<DispatchTask<>> quickOnes;
+        for (int i = 0; i < 10000; ++i)
+            quickOnes.push_back(quick(mutex));
+        mutex.unlock();
+        co_await whenAll(std::move(quickOnes));
+        CHECK(served == 10000);
+    }
+
+    {
+        AsyncSemaphore semaphore(3);
+        static std::atomic<int> running = 0;
+        static std::atomic<int> maxRunning = 0;
+        auto worker = [conq](AsyncSemaphore & semaphore) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            auto permit = co_await semaphore.scopedAcquire();
+            int now = ++running;
+            for (int prev = maxRunning; prev < now && !maxRunning.compare_exchange_weak(prev, now); ) {}
+            co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 1 * NSEC_PER_MSEC));
+            --running;
+        };
+        std::vector<DispatchTask<>> workers;
+        for (int i = 0; i < 20; ++i)
+            workers.push_back(worker(semaphore));
+        co_await whenAll(std::move(workers));
+        CHECK(maxRunning <= 3);
+        CHECK(semaphore.tryAcquire());
+        CHECK(semaphore.tryAcquire());
+        CHECK(semaphore.tryAcquire());
+        CHECK(!semaphore.tryAcquire());
+        semaphore.release(3);
+    }
+
+    {
+        AsyncSharedMutex mutex;
+        CHECK(mutex.tryLockShared());
+        CHECK(mutex.tryLockShared());
+        CHECK(!mutex.tryLock());
+        mutex.unlockShared();
+        mutex.unlockShared();
+
+        static std::atomic<int> readers = 0;
+        static std::atomic<int> writers = 0;
+        static std::atomic<bool> violated = false;
+        auto reader = [conq](AsyncSharedMutex & mutex) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            for (int i = 0; i < 50; ++i) {
+                auto guard = co_await mutex.scopedLockShared();
+                ++readers;
+                if (writers != 0)
+                    violated = true;
+                --readers;
+            }
+        };
+        auto writer = [conq](AsyncSharedMutex & mutex) -> DispatchTask<> {
+            co_await resumeOn(conq);
+            for (int i = 0; i < 50; ++i) {
+                auto guard = co_await mutex.scopedLock();
+                if (++writers != 1 || readers != 0)
+                    violated = true;
+                --writers;
+            }
+        };
+        std::vector<DispatchTask<>> workers;
+        for (int i = 0; i < 6; ++i)
+            workers.push_back(i % 3 == 0 ? writer(mutex) : reader(mutex));
+        co_await whenAll(std::move(workers));
+        CHECK(!violated);
+    }
+}
+
+static auto checkBatchGenerator() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    {
+        auto generate = [](int count) -> DispatchBatchGenerator<std::unique_ptr<int>> {
+            for (int i = 0; i < count; ++i)
+                co_yield std::make_unique<int>(i);
+        };
+
+        std::vector<size_t> sizes;
+        std::vector<int> res;
+        for (auto it = co_await generate(1000).withBatchSize(64).beginOn(conq); it; co_await it.next()) {
+            auto batch = *it;
+            sizes.push_back(batch.size());
+            for (auto & value : batch)
+                res.push_back(*std::move(value));
+        }
+        CHECK(sizes.size() == 16);
+        CHECK(std::all_of(sizes.begin(), sizes.end() - 1, [](size_t size) { return size == 64; }));
+        CHECK(sizes.back() == 1000 - 15 * 64);
+        CHECK(res.size() == 1000);
+        CHECK(std::is_sorted(res.begin(), res.end()));
+
+        auto it = co_await generate(0).beginSync();
+        CHECK(!it);
+    }
+
+#ifdef __cpp_exceptions
+    {
+        auto generate = []() -> DispatchBatchGenerator<int> {
+            for (int i = 0; i < 10; ++i)
+                co_yield i;
+            throw std::runtime_error("oops");
+        };
+
+        size_t received = 0;
+        try {
+            for (auto it = co_await generate().beginOn(conq); it; co_await it.next())
+                received += (*it).size();
+            FAIL("exception expected");
+        } catch (std::runtime_error & ex) {
+            CHECK(std::string(ex.what()) == "oops");
+        }
+        CHECK(received == 10);
+    }
+#endif
+}
+
+static auto checkPrefetch() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    static std::atomic<int> produced = 0;
+    static std::atomic<bool> destroyed = false;
+    struct Sentinel {
+        ~Sentinel() { destroyed = true; }
+    };
+    auto generate = [](int count) -> DispatchGenerator<int> {
+        Sentinel sentinel;
+        for (int i = 0; i < count; ++i) {
+            ++produced;
+            co_yield i;
+        }
+    };
+
+    {
+        std::vector<int> res;
+        bool ranAhead = false;
+        for (auto it = co_await generate(100).prefetch(4, conq).beginOn(conq); it; co_await it.next()) {
+            if (res.empty()) {
+                co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 20 * NSEC_PER_MSEC));
+                ranAhead = produced >= 4;
+            }
+            res.push_back(*it);
+        }
+        CHECK(ranAhead);
+        CHECK(res.size() == 100);
+        CHECK(std::is_sorted(res.begin(), res.end()));
+    }
+
+    {
+        destroyed = false;
+        int received = 0;
+        for (auto it = co_await generate(1000000).prefetch(8, conq).beginSync(); it; co_await it.next()) {
+            if (++received == 5)
+                break;
+        }
+        for (int i = 0; i < 100 && !destroyed; ++i)
+            co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, 1 * NSEC_PER_MSEC));
+        CHECK(destroyed);
+    }
+
+#ifdef __cpp_exceptions
+    {
+        auto failing = []() -> DispatchGenerator<int> {
+            co_yield 1;
+            co_yield 2;
+            throw std::runtime_error("oops");
+        };
+
+        std::vector<int> res;
+        try {
+            for (auto it = co_await failing().prefetch(8).beginOn(conq); it; co_await it.next())
+                res.push_back(*it);
+            FAIL("exception expected");
+        } catch (std::runtime_error & ex) {
+            CHECK(std::string(ex.what()) == "oops");
+        }
+        CHECK(res == std::vector{1, 2});
+    }
+#endif
+}
+
+static auto checkPipeline() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+    auto serial = dispatch_queue_create("sink", DISPATCH_QUEUE_SERIAL);
+
+    auto numbers = [](int count) -> DispatchGenerator<int> {
+        for (int i = 0; i < count; ++i)
+            co_yield i;
+    };
+
+    {
+        PipelineStats squareStats;
+        PipelineStats sinkStats;
+        std::vector<std::string> res;
+        co_await (numbers(100)
+                  | pipelineStage(conq, [](int i) { return i * i; }).withStats(squareStats)
+                  | pipelineStage(conq, [conq](int i) -> DispatchTask<std::string> {
+                        co_await resumeOn(conq);
+                        co_return std::to_string(i);
+                    }, 4)
+                  | pipelineSink(serial, [&](std::string str) { res.push_back(std::move(str)); }).withStats(sinkStats));
+        CHECK(res.size() == 100);
+        CHECK(res[9] == "81");
+        CHECK(res[99] == "9801");
+        CHECK(squareStats.items() == 100);
+        CHECK(sinkStats.items() == 100);
+        CHECK(sinkStats.waitingForOutput().count() == 0);
+    }
+
+    {
+        //the first stage holds back the second item until the last stage has received the first one
+        //which only happens early if the stages run concurrently
+        CancellationSource firstArrived;
+        bool overlapped = false;
+        auto first = [&](int i) -> DispatchTask<int> {
+            if (i == 1)
+                overlapped = !co_await sleepFor(std::chrono::seconds(10)).withCancellation(firstArrived.token());
+            co_return i;
+        };
+        auto middle = [conq](int i) -> DispatchTask<int> {
+            co_await resumeOn(conq);
+            co_return i;
+        };
+        auto last = [&](int i) -> DispatchTask<int> {
+            if (i == 0)
+                firstArrived.cancel();
+            co_return i;
+        };
+        PipelineStats stats[3];
+        int count = 0;
+        auto pipeline = numbers(20)
+                        | pipelineStage(conq, first).withStats(stats[0])
+                        | pipelineStage(conq, middle).withStats(stats[1])
+                        | pipelineStage(conq, last).withStats(stats[2]);
+        for (auto it = co_await std::move(pipeline).beginOn(conq); it; co_await it.next())
+            ++count;
+        CHECK(count == 20);
+        CHECK(overlapped);
+        for (auto & stageStats: stats)
+            CHECK(stageStats.items() == 20);
+    }
+
+#ifdef __cpp_exceptions
+    {
+        int received = 0;
+        try {
+            co_await (numbers(10)
+                      | pipelineStage(conq, [](int i) {
+                            if (i == 5)
+                                throw std::runtime_error("oops");
+                            return i;
+                        })
+                      | pipelineSink(serial, [&](int) { ++received; }));
+            FAIL("exception expected");
+        } catch (std::runtime_error & ex) {
+            CHECK(std::string(ex.what()) == "oops");
+        }
+        CHECK(received == 5);
+    }
+#endif
+
+    dispatch_release(serial);
+}
+
+static auto checkTimers() -> DispatchTask<> {
+
+    using namespace std::chrono_literals;
+    using Clock = std::chrono::steady_clock;
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    {
+        auto start = Clock::now();
+        CHECK(co_await sleepFor(20ms).resumeOnMainQueue());
+        CHECK(isMainQueue());
+        CHECK(Clock::now() - start >= 20ms);
+    }
+
+    {
+        CancellationSource source;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 20 * NSEC_PER_MSEC), conq, ^ {
+            source.cancel();
+        });
+        auto start = Clock::now();
+        CHECK(!co_await sleepFor(10s).withCancellation(source.token()).resumeOnMainQueue());
+        CHECK(isMainQueue());
+        CHECK(Clock::now() - start < 5s);
+        CHECK(!co_await sleepFor(10s).withCancellation(source.token()));
+    }
+
+    //many concurrent sleepers with and without leeway
+    {
+        static std::atomic<int> early = 0;
+        auto sleeper = [](int ms) -> DispatchTask<> {
+            auto start = Clock::now();
+            co_await sleepFor(std::chrono::milliseconds(ms), std::chrono::milliseconds(ms % 8));
+            if (Clock::now() - start < std::chrono::milliseconds(ms))
+                ++early;
+        };
+        std::vector<DispatchTask<>> sleepers;
+        for (int i = 0; i < 5000; ++i)
+            sleepers.push_back(sleeper(i % 100));
+        co_await whenAll(std::move(sleepers));
+        CHECK(early == 0);
+    }
+
+    auto delayed = [conq](uint64_t ms) -> DispatchTask<int> {
+        co_await resumeOn(conq, dispatch_time(DISPATCH_TIME_NOW, ms * NSEC_PER_MSEC));
+        co_return 5;
+    };
+
+    CHECK(co_await withTimeout(delayed(1), 5s).resumeOnMainQueue() == 5);
+    CHECK(isMainQueue());
+    CHECK(!co_await withTimeout(delayed(5000), 20ms));
+    CHECK(co_await withTimeout(co_dispatch(conq, []() {}), 5s));
+    CHECK(!co_await withTimeout(makeAwaitable<void>([conq](auto promise) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 200 * NSEC_PER_MSEC), conq, ^ {
+            promise.success();
+        });
+    }), 1ms));
+
+    //abandoned inner task observes cancellation
+    {
+        //the inner operation only completes when we tell it to, after the timeout has fired
+        static std::function<void ()> complete;
+        static bool sawCancel = false;
+        auto observing = makeAwaitable<int>([](auto promise) {
+            complete = [promise]() mutable {
+                sawCancel = promise.isCancelled();
+                promise.success(1);
+            };
+        });
+        CHECK(!co_await withTimeout(std::move(observing), 10ms));
+        REQUIRE(complete);
+        complete();
+        complete = nullptr;
+        CHECK(sawCancel);
+    }
+
+    //timeouts that mostly do not fire
+    {
+        std::vector<DispatchTask<bool>> tasks;
+        for (int i = 0; i < 2000; ++i) {
+            tasks.push_back([](DispatchTask<int> inner) -> DispatchTask<bool> {
+                co_return (co_await withTimeout(std::move(inner), 10s)).has_value();
+            }(delayed(i % 10)));
+        }
+        auto results = co_await whenAll(std::move(tasks));
+        CHECK(std::all_of(results.begin(), results.end(), [](bool res) { return res; }));
+    }
+
+#ifdef __cpp_exceptions
+    auto failing = [conq]() -> DispatchTask<int> {
+        co_await resumeOn(conq);
+        throw std::runtime_error("oops");
+    };
+    try {
+        co_await withTimeout(failing(), 5s);
+        FAIL("exception expected");
+    } catch (std::runtime_error & ex) {
+        CHECK(std::string(ex.what()) == "oops");
+    }
+#endif
+}
+
+static auto checkFdReadiness() -> DispatchTask<> {
+
+    auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    for (int fd: fds)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    auto sendAll = [conq](int fd, const char * data, size_t size) -> DispatchTask<bool> {
+        while (size) {
+            auto sent = send(fd, data, size, 0);
+            if (sent < 0) {
+                if (errno != EAGAIN || !co_await writable(fd, conq))
+                    co_return false;
+                continue;
+            }
+            data += sent;
+            size -= size_t(sent);
+        }
+        co_return true;
+    };
+
+    //echo server
+    auto echo = [conq, sendAll](int fd) -> DispatchTask<size_t> {
+        size_t total = 0;
+        char buf[256];
+        while (co_await readable(fd, conq)) {
+            for ( ; ; ) {
+                auto received = recv(fd, buf, sizeof(buf), 0);
+                if (received == 0)
+                    co_return total;
+                if (received < 0)
+                    break;
+                total += size_t(received);
+                if (!co_await sendAll(fd, buf, size_t(received)))
+                    co_return total;
+            }
+        }
+        co_return total;
+    };
+    auto server = echo(fds[1]);
+
+    std::string message(100'000, 0);
+    for (size_t i = 0; i < message.size(); ++i)
+        message[i] = char('a' + i % 26);
+    auto client = [conq, sendAll](int fd, const std::string & message) -> DispatchTask<std::string> {
+        auto writer = sendAll(fd, message.data(), message.size());
+        std::string echoed;
+        char buf[1024];
+        while (echoed.size() < message.size()) {
+            if (!co_await readable(fd, conq))
+                break;
+            for (ssize_t received; (received = recv(fd, buf, sizeof(buf), 0)) > 0; )
+                echoed.append(buf, size_t(received));
+        }
+        CHECK(co_await std::move(writer));
+        co_return echoed;
+    };
+    CHECK(co_await client(fds[0], message) == message);
+
+    shutdown(fds[0], SHUT_WR);
+    CHECK(co_await std::move(server) == message.size());
+
+    //stopping resumes waiters
+    auto waiter = [conq](int fd) -> DispatchTask<bool> {
+        co_return co_await readable(fd, conq);
+    };
+    auto waiting = waiter(fds[0]);
+    co_await sleepFor(std::chrono::milliseconds(20));
+    co_await stopWatching(fds[0]);
+    CHECK(!co_await std::move(waiting));
+    co_await stopWatching(fds[1]);
+    co_await stopWatching(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static auto checkSockets() -> DispatchTask<> {
+
+    //accept over loopback
+    {
+        int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(listenFd != -1);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        REQUIRE(bind(listenFd, (sockaddr *)&addr, sizeof(addr)) == 0);
+        REQUIRE(listen(listenFd, 4) == 0);
+        socklen_t len = sizeof(addr);
+        REQUIRE(getsockname(listenFd, (sockaddr *)&addr, &len) == 0);
+        DispatchSocket listener(listenFd);
+        
+        auto accepting = listener.accept();
+        co_await sleepFor(std::chrono::milliseconds(10));
+        
+        int clientFd = socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(connect(clientFd, (sockaddr *)&addr, sizeof(addr)) == 0);
+        DispatchSocket client(clientFd);
+        
+        auto [server, err] = co_await std::move(accepting);
+        CHECK(err == 0);
+        REQUIRE(server);
+        
+        const char greeting[] = "hello";
+        auto written = co_await client.writeAll(std::as_bytes(std::span(greeting)));
+        CHECK(written.transferred() == sizeof(greeting));
+        CHECK(written.error() == 0);
+        std::array<std::byte, 16> buf;
+        size_t total = 0;
+        while (total < sizeof(greeting)) {
+            auto res = co_await server.readSome(std::span(buf).subspan(total));
+            REQUIRE(res.error() == 0);
+            REQUIRE(res.transferred() != 0);
+            total += res.transferred();
+        }
+        CHECK(memcmp(buf.data(), greeting, sizeof(greeting)) == 0);
+    }
+    
+    //large transfer with buffers reused across reads
+    {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        DispatchSocket first(fds[0]), second(fds[1]);
+        
+        std::vector<std::byte> message(1'000'000);
+        for (size_t i = 0; i < message.size(); ++i)
+            message[i] = std::byte(i % 251);
+        
+        auto reader = [](DispatchSocket & socket) -> DispatchTask<std::vector<std::byte>> {
+            std::vector<std::byte> received;
+            std::array<std::byte, 4096> buf;
+            for ( ; ; ) {
+                auto res = co_await socket.readSome(buf);
+                if (res.error() || res.transferred() == 0)
+                    break;
+                received.insert(received.end(), buf.begin(), buf.begin() + ptrdiff_t(res.transferred()));
+            }
+            co_return received;
+        };
+        auto reading = reader(second);
+        auto written = co_await first.writeAll(message);
+        CHECK(written.transferred() == message.size());
+        CHECK(written.error() == 0);
+        CHECK(first.shutdown() == 0);
+        CHECK(co_await std::move(reading) == message);
+    }
+}
+
 static DispatchTask<> runTests() {
     
     auto conq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
     
+    co_await checkFramePool();
+    co_await checkAwaitableStates();
+    co_await checkCurrentQueueDetection();
+    co_await checkWhenAll();
+    co_await checkWhenAny();
+    co_await checkCancellation();
+    co_await checkTaskGroup();
+    co_await checkApply();
+    co_await checkChannel();
+    co_await checkAsyncLocks();
+    co_await checkBatchGenerator();
+    co_await checkPrefetch();
+    co_await checkPipeline();
+    co_await checkTimers();
+    co_await checkFdReadiness();
+    co_await checkSockets();
+#if __cpp_lib_ranges
+    co_await checkTransformReduce();
+#endif
+
     int i = co_await co_dispatch([&]() {
         return 7;
     });
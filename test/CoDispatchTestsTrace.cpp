@@ -0,0 +1,68 @@
+#define CO_DISPATCH_TRACE 1
+#include <objc-helpers/CoDispatch.h>
+
+#include "doctest.h"
+
+#include "TestGlobal.h"
+
+#include <string>
+
+static DispatchTask<int> addOne(int val) {
+    co_await resumeOn(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    co_return val + 1;
+}
+
+static DispatchGenerator<int> countTo(int n) {
+    for (int i = 1; i <= n; ++i)
+        co_yield i;
+}
+
+static size_t countEvents(const std::string & json, const std::string & name, const char * phase) {
+    auto pattern = "\"name\":\"" + name + "\",\"cat\":\"coroutine\",\"ph\":\"" + phase + "\"";
+    size_t ret = 0;
+    for (auto pos = json.find(pattern); pos != json.npos; pos = json.find(pattern, pos + 1))
+        ++ret;
+    return ret;
+}
+
+static DispatchTask<> runTests() {
+    auto queue = dispatch_queue_create("trace", DISPATCH_QUEUE_SERIAL);
+    drainDispatchTrace();
+    
+    //resuming on a queue other than the current one always goes through dispatch
+    auto i = co_await addOne(1).resumeOn(queue);
+    CHECK(i == 2);
+    
+    auto json = drainDispatchTrace();
+    CHECK(json.starts_with("{\"traceEvents\":["));
+    CHECK(json.ends_with("}"));
+    CHECK(json.find("\"name\":\"task\",\"cat\":\"coroutine\",\"ph\":\"b\"") != json.npos);
+    CHECK(json.find("\"name\":\"task\",\"cat\":\"coroutine\",\"ph\":\"e\"") != json.npos);
+    CHECK(json.find("\"name\":\"queued\",\"cat\":\"coroutine\",\"ph\":\"b\"") != json.npos);
+    CHECK(json.find("\"name\":\"run\",\"cat\":\"coroutine\",\"ph\":\"B\"") != json.npos);
+    
+    //generators suspend many times but have a single task span
+    int sum = 0;
+    for (auto it = co_await countTo(3).beginOn(queue); it; co_await it.next())
+        sum += *it;
+    CHECK(sum == 6);
+    
+    json = drainDispatchTrace();
+    CHECK(countEvents(json, "task", "b") == 1);
+    CHECK(countEvents(json, "task", "e") == 1);
+    CHECK(countEvents(json, "started", "n") == 1);
+    CHECK(countEvents(json, "yielded", "n") == 3);
+    CHECK(countEvents(json, "resumed", "n") == 3);
+    CHECK(countEvents(json, "completed", "n") == 1);
+    
+    dispatch_release(queue);
+    
+    finishAsyncTest();
+}
+
+
+TEST_CASE("CoDispatchTestsTrace") {
+    waitForAsyncTest(^ {
+        runTests();
+    });
+}